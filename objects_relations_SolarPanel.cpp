@@ -32,21 +32,248 @@ Last, but not least, sometimes there is no obvious way to do that.
 */
 #include <iostream>
 #include <cmath>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <limits>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#include <random>
+#include <span>
+#include <string>
+#include <fstream>
+#include <stdexcept>
+#include <memory>
+#include <memory_resource>
+#include <array>
+#include <utility>
+#include <type_traits>
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <future>
+#include <atomic>
+#include <string_view>
+#include <cstring>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <initializer_list>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
 
 using namespace std;
 
 constexpr double pi = 3.1415;
+constexpr double exactPi = 3.14159265358979323846; // where the zeros of std::cos matter
+
+// std::cos and std::sin can't be used at compile time (before C++26), these can.
+// Taylor series after reducing the angle to [-pi, pi], accurate to a few units of the last digit.
+constexpr double taylorCos(double x) {
+    x -= 2 * exactPi * static_cast<long long>(x / (2 * exactPi));
+    if (x > exactPi) x -= 2 * exactPi;
+    else if (x < -exactPi) x += 2 * exactPi;
+    double term = 1, sum = 1;
+    for (int n = 1; n < 30; ++n) {
+        term *= -x * x / ((2 * n - 1) * (2 * n));
+        sum += term;
+    }
+    return sum;
+}
+constexpr double taylorSin(double x) { return taylorCos(x - exactPi / 2); }
+
+// the Taylor series when evaluated by the compiler, the usual std::cos/std::sin at run time
+constexpr double constexprCos(double x) { return std::is_constant_evaluated() ? taylorCos(x) : std::cos(x); }
+constexpr double constexprSin(double x) { return std::is_constant_evaluated() ? taylorSin(x) : std::sin(x); }
+
+// Structured logging for the model classes. A record is a level, a static event name and a few named numbers;
+// it is put in a lock-free queue and formatted and written (to std::clog) by a background thread,
+// which sleeps while the queue is empty and is woken by the producer that finds it asleep.
+// A forked process (see ShardedSweepRunner) has no writer thread, there records are written right away.
+// The level check is a relaxed atomic load, so a disabled log call in a mutator costs next to nothing,
+// and an enabled one never waits for the output (if the queue is full the record is dropped and counted).
+enum class LogLevel { Debug, Info, Warning, Error, Off };
+
+struct LogField {
+    const char* key;
+    double value;
+};
+
+class Logger {
+public:
+    static bool enabled(LogLevel level) { return level >= s_level.load(std::memory_order_relaxed); }
+    static void setLevel(LogLevel level) { s_level.store(level, std::memory_order_relaxed); }
+
+    static void log(LogLevel level, const char* event, std::initializer_list<LogField> fields = {}) {
+        if (!enabled(level)) return;
+        Logger& logger = instance();
+        if (getpid() == logger.m_pid) logger.push(level, event, fields);
+        else logger.writeNow(level, event, fields);
+    }
+    // waits until everything logged so far is written
+    static void flush() {
+        Logger& logger = instance();
+        if (getpid() == logger.m_pid) logger.drain();
+        else std::clog.flush();
+    }
+    static size_t dropped() { return instance().m_dropped.load(std::memory_order_relaxed); }
+
+private:
+    static constexpr size_t queueSize = 4096; // power of two
+    static constexpr int maxFields = 4;
+    struct Record {
+        LogLevel level;
+        const char* event;
+        int nFields;
+        LogField fields[maxFields];
+    };
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    Logger() : m_cells(queueSize) {
+        for (size_t i = 0; i < queueSize; ++i) m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        m_writer = std::thread([this] { writerLoop(); });
+    }
+    ~Logger() {
+        m_stop.store(true);
+        m_idle.store(false);
+        m_idle.notify_one();
+        m_writer.join();
+    }
+    static Logger& instance() {
+        static Logger logger;
+        return logger;
+    }
+
+    // bounded multi-producer queue (D. Vyukov): every cell carries the sequence number it expects next
+    void push(LogLevel level, const char* event, std::initializer_list<LogField> fields) {
+        size_t position = m_enqueue.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = m_cells[position & (queueSize - 1)];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            if (sequence == position) {
+                if (m_enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    cell.record.level = level;
+                    cell.record.event = event;
+                    cell.record.nFields = 0;
+                    for (const LogField& field : fields)
+                        if (cell.record.nFields < maxFields) cell.record.fields[cell.record.nFields++] = field;
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    // pairs with the fence of the writer going idle: either it sees this record or we see it asleep
+                    std::atomic_thread_fence(std::memory_order_seq_cst);
+                    if (m_idle.load(std::memory_order_relaxed) && m_idle.exchange(false)) m_idle.notify_one();
+                    return;
+                }
+            } else if (sequence < position) {
+                m_dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+            } else {
+                position = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    bool pop(Record& record) {
+        Cell& cell = m_cells[m_dequeue & (queueSize - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != m_dequeue + 1) return false;
+        record = cell.record;
+        cell.sequence.store(m_dequeue + queueSize, std::memory_order_release);
+        ++m_dequeue;
+        return true;
+    }
+
+    static void format(const Record& record, std::string& line) {
+        static const char* names[] = { "debug", "info", "warning", "error" };
+        line.assign("[").append(names[static_cast<int>(record.level)]).append("] ").append(record.event);
+        for (int i = 0; i < record.nFields; ++i) {
+            char number[32];
+            char* end = std::to_chars(number, number + sizeof(number), record.fields[i].value).ptr;
+            line.append(" ").append(record.fields[i].key).append("=").append(number, end);
+        }
+        line.push_back('\n');
+    }
+
+    // in a forked process nobody reads the queue (and _exit would drop it): format and write on the spot
+    void writeNow(LogLevel level, const char* event, std::initializer_list<LogField> fields) {
+        Record record{ level, event, 0, {} };
+        for (const LogField& field : fields)
+            if (record.nFields < maxFields) record.fields[record.nFields++] = field;
+        std::string line;
+        format(record, line);
+        std::clog << line << std::flush;
+    }
+
+    void writerLoop() {
+        std::string line;
+        Record record;
+        for (;;) {
+            bool wrote = false;
+            while (pop(record)) {
+                format(record, line);
+                std::clog << line;
+                wrote = true;
+            }
+            if (wrote) {
+                std::clog.flush();
+                m_written.store(m_dequeue, std::memory_order_release);
+                m_written.notify_all();
+            }
+            if (m_stop.load() && m_dequeue == m_enqueue.load()) return;
+            if (wrote) continue;
+            m_idle.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (hasRecord() || m_stop.load()) { m_idle.store(false); continue; }
+            m_idle.wait(true);
+        }
+    }
+
+    bool hasRecord() const {
+        return m_cells[m_dequeue & (queueSize - 1)].sequence.load(std::memory_order_acquire) == m_dequeue + 1;
+    }
+
+    void drain() {
+        size_t target = m_enqueue.load();
+        for (size_t written; (written = m_written.load(std::memory_order_acquire)) < target;) m_written.wait(written);
+    }
+
+    static inline std::atomic<LogLevel> s_level{ LogLevel::Info };
+    std::vector<Cell> m_cells;
+    std::atomic<size_t> m_enqueue{ 0 };
+    size_t m_dequeue = 0; // only used by the writer
+    std::atomic<size_t> m_written{ 0 };
+    std::atomic<size_t> m_dropped{ 0 };
+    std::atomic<bool> m_stop{ false };
+    std::atomic<bool> m_idle{ false }; // the writer is (about to be) waiting for a record
+    const pid_t m_pid = getpid();      // process the writer thread runs in
+    std::thread m_writer;
+};
 
 class SolarPanel {
 public:
-    SolarPanel(int dimX, int dimY)
+    constexpr SolarPanel(int dimX, int dimY)
         : m_dimx(dimX), m_dimy(dimY) {}
-    inline double dimXinCM() const { return m_dimx * oneElementX; }
-    inline double dimYinCM() const { return m_dimy * oneElementY; }
-    inline double areainCM2() const { return dimXinCM() * dimYinCM(); }
-    inline double maxPowerinW() const { return m_dimx * m_dimy * oneElementPowerinW; }
-    inline void shrinkXto(int nelements) { m_dimx = nelements; }
-    inline void shrinkYto(int nelements) { m_dimy = nelements; }
+    constexpr double dimXinCM() const { return m_dimx * oneElementX; }
+    constexpr double dimYinCM() const { return m_dimy * oneElementY; }
+    constexpr double areainCM2() const { return dimXinCM() * dimYinCM(); }
+    constexpr double maxPowerinW() const { return m_dimx * m_dimy * oneElementPowerinW; }
+    constexpr int nElementsX() const { return m_dimx; }
+    constexpr int nElementsY() const { return m_dimy; }
+    constexpr void shrinkXto(int nelements) { m_dimx = nelements; }
+    constexpr void shrinkYto(int nelements) { m_dimy = nelements; }
 
 private:
     constexpr static float oneElementX = 6; // it is identical to what was in earlier exercise but with slightly more modern syntax
@@ -61,26 +288,28 @@ private:
 class PanelSetup {
 public:
 
-    PanelSetup(double angle = 0, const SolarPanel& panel = SolarPanel(20, 30))
+    constexpr PanelSetup(double angle = 0, const SolarPanel& panel = SolarPanel(20, 30))
         : m_orientationAngle(angle), m_panel(panel) {}; // here the default arguments are used to be able to construct the PanelSetup w/o any arguments if needed
         //PanelSetup(): m_orientationAngle(0), m_panel(SolarPanel(20, 30)) {} ;
 
-    double currentPower(double angleInRadians) const {
-        double curPow = std::cos(angleInRadians) > 0 ? m_panel.maxPowerinW() * std::cos(angleInRadians) : 0;
+    // constexprCos is std::cos at run time, the constexpr versions only matter for compile-time tables (Exercise 14)
+    constexpr double currentPower(double angleInRadians) const {
+        double curPow = constexprCos(angleInRadians) > 0 ? m_panel.maxPowerinW() * constexprCos(angleInRadians) : 0;
         return curPow;
     };
     // fraction of power produced compared to max
-    double efficiency(double angleInRadians) const {
-        double eff = std::cos(angleInRadians) > 0 ? 100 * currentPower(angleInRadians) / m_panel.maxPowerinW() : 0;
+    constexpr double efficiency(double angleInRadians) const {
+        double eff = constexprCos(angleInRadians) > 0 ? 100 * currentPower(angleInRadians) / m_panel.maxPowerinW() : 0;
         return eff;
     };
-    double getAngle() const { return m_orientationAngle; };
-    double setAngle(double newangleInRadians) { return m_orientationAngle = newangleInRadians; };
+    constexpr double getAngle() const { return m_orientationAngle; };
+    constexpr double setAngle(double newangleInRadians) { return m_orientationAngle = newangleInRadians; };
     // IMPORTANT!! const SolarPanel& getPanel() const { return m_panel; } can't be modified
-    SolarPanel& getPanel()  { return m_panel; } // add reference (&) to make it modifiable, otherwise it's just copying m_panel
+    constexpr SolarPanel& getPanel()  { return m_panel; } // add reference (&) to make it modifiable, otherwise it's just copying m_panel
+    constexpr const SolarPanel& getPanel() const { return m_panel; } // read-only access for const setups
     void setNPanel(int nx, int ny) {
         m_panel.shrinkXto(nx);  m_panel.shrinkYto(ny);
-        cout<<m_panel.areainCM2() << endl;
+        Logger::log(LogLevel::Debug, "panel_resized", { { "nx", double(nx) }, { "ny", double(ny) }, { "area_cm2", m_panel.areainCM2() } });
     }
 private:
     double m_orientationAngle;
@@ -96,12 +325,14 @@ private:
 
 
 struct LightSource {
-    LightSource()
+    constexpr LightSource()
         : m_SourceAngle() {};
+    constexpr explicit LightSource(double LightSourceAngle)
+        : m_SourceAngle(LightSourceAngle) {};
 public:
-    void setSourceAngle(double LightSourceAngle) { m_SourceAngle = LightSourceAngle; };
-    void moveSourceAngleBy(double dSourceAngle) { m_SourceAngle += dSourceAngle; };
-    double getSourceAngle() const { return m_SourceAngle; };
+    constexpr void setSourceAngle(double LightSourceAngle) { m_SourceAngle = LightSourceAngle; };
+    constexpr void moveSourceAngleBy(double dSourceAngle) { m_SourceAngle += dSourceAngle; };
+    constexpr double getSourceAngle() const { return m_SourceAngle; };
 private:
     double m_SourceAngle;
 };
@@ -112,11 +343,249 @@ private:
 // Setters/getters are trivial.
 
 
-double LuminationAngle(PanelSetup somesetup, LightSource somelightsource) {
+constexpr double LuminationAngle(const PanelSetup& somesetup, const LightSource& somelightsource) {
     if(somesetup.getAngle()<0) return pi / 2 - somelightsource.getSourceAngle() + somesetup.getAngle();
     else return pi / 2 + somelightsource.getSourceAngle() - somesetup.getAngle();
 }
 
+// LuminationAngle for a whole array of setups. Plants mixing both signs of tilt (like Exercise 5) make the
+// branch above unpredictable, here both formulas are computed and one is selected, which compiles to a blend.
+// The results are bit for bit the ones of LuminationAngle.
+void LuminationAngles(std::span<const PanelSetup> setups, const LightSource& source, std::span<double> angles) {
+    double sunAngle = source.getSourceAngle();
+    for (size_t i = 0; i < setups.size(); ++i) {
+        double tilt = setups[i].getAngle();
+        int64_t negativeTilt = std::bit_cast<int64_t>(pi / 2 - sunAngle + tilt);
+        int64_t positiveTilt = std::bit_cast<int64_t>(pi / 2 + sunAngle - tilt);
+        int64_t useNegative = -static_cast<int64_t>(tilt < 0); // all bits set or none, a plain ?: gets turned back into a jump
+        angles[i] = std::bit_cast<double>((negativeTilt & useNegative) | (positiveTilt & ~useNegative));
+    }
+}
+
+// currentPower and efficiency of every setup for every sun position with one cos per (setup, sun) pair
+// (calling both methods costs four). Results are row-major [sun][setup], both buffers must hold
+// suns.size() * setups.size() values. The values are the same as the ones of the two methods.
+void powerAndEfficiency(std::span<const PanelSetup> setups, std::span<const LightSource> suns,
+                        std::span<double> power, std::span<double> efficiency) {
+    for (size_t k = 0; k < suns.size(); ++k) {
+        std::span<double> powerRow = power.subspan(k * setups.size(), setups.size());
+        std::span<double> efficiencyRow = efficiency.subspan(k * setups.size(), setups.size());
+        LuminationAngles(setups, suns[k], powerRow); // the angles are overwritten by the power below
+        for (size_t i = 0; i < setups.size(); ++i) {
+            double cosine = std::cos(powerRow[i]);
+            double maxPower = setups[i].getPanel().maxPowerinW();
+            double current = cosine > 0 ? maxPower * cosine : 0;
+            powerRow[i] = current;
+            efficiencyRow[i] = cosine > 0 ? 100 * current / maxPower : 0;
+        }
+    }
+}
+
+// cos(LuminationAngle) is a pure sinusoid of the sun angle: a*cos(sunAngle) + b*sin(sunAngle) (scaled by the max power here).
+// The setup produces max(0, a*cos + b*sin), which lets the tools below skip the per-panel branch and cos call.
+struct SinusoidTerm {
+    double a, b;
+};
+
+constexpr SinusoidTerm sinusoidTerm(double tilt, double maxPower) {
+    if (tilt < 0) {
+        double c = pi / 2 + tilt; // cos(c - sunAngle)
+        return { maxPower * constexprCos(c), maxPower * constexprSin(c) };
+    }
+    double c = pi / 2 - tilt;     // cos(sunAngle + c)
+    return { maxPower * constexprCos(c), -maxPower * constexprSin(c) };
+}
+
+constexpr SinusoidTerm sinusoidTerm(const PanelSetup& setup) { return sinusoidTerm(setup.getAngle(), setup.getPanel().maxPowerinW()); }
+
+
+// Optimizers and Monte Carlo loops build and throw away lots of temporary plants.
+// Arena hands out memory from a few big blocks and frees nothing individually: reset() makes all of it
+// available again while keeping the blocks, so a loop that resets it every iteration stops touching the heap
+// once the blocks are big enough. Everything allocated from it must be destroyed before reset().
+class Arena : public std::pmr::memory_resource {
+public:
+    explicit Arena(size_t blockSize = 64 * 1024) : m_blockSize(blockSize) {}
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void reset() { m_current = 0; m_used = 0; }
+    size_t capacity() const {
+        size_t total = 0;
+        for (const auto& block : m_blocks) total += block.size;
+        return total;
+    }
+
+private:
+    void* do_allocate(size_t bytes, size_t alignment) override {
+        for (;; ++m_current, m_used = 0) {
+            if (m_current == m_blocks.size()) {
+                size_t size = std::max(m_blockSize, bytes + alignment);
+                m_blocks.push_back({ std::make_unique<char[]>(size), size });
+                m_blockSize *= 2;
+            }
+            Block& block = m_blocks[m_current];
+            void* pointer = block.data.get() + m_used;
+            size_t space = block.size - m_used;
+            if (std::align(alignment, bytes, pointer, space)) {
+                m_used = block.size - space + bytes;
+                return pointer;
+            }
+        }
+    }
+    void do_deallocate(void*, size_t, size_t) override {}
+    bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+    struct Block {
+        std::unique_ptr<char[]> data;
+        size_t size;
+    };
+    std::vector<Block> m_blocks;
+    size_t m_blockSize;
+    size_t m_current = 0; // block being filled
+    size_t m_used = 0;    // bytes used in it
+};
+
+
+// vector-like storage keeping up to N elements inside the object itself, only bigger sizes go to the heap
+// (allocated from the memory resource, like the std::pmr containers a copy uses the default resource)
+template <class T, size_t N>
+class SmallVector {
+public:
+    explicit SmallVector(std::pmr::memory_resource* resource = std::pmr::get_default_resource()) : m_resource(resource) {}
+    SmallVector(size_t n, const T& value, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource) { resize(n, value); }
+    SmallVector(const SmallVector& other) { assign(other.begin(), other.end()); }
+    SmallVector(SmallVector&& other) noexcept : m_resource(other.m_resource) { take(std::move(other)); }
+    ~SmallVector() { clear(); release(); }
+
+    SmallVector& operator=(const SmallVector& other) {
+        if (this != &other) { clear(); assign(other.begin(), other.end()); }
+        return *this;
+    }
+    // may allocate (and throw) when the two use different memory resources
+    SmallVector& operator=(SmallVector&& other) {
+        if (this != &other) {
+            clear();
+            if (*m_resource == *other.m_resource) { release(); take(std::move(other)); }
+            else { for (T& element : other) push_back(std::move(element)); other.clear(); }
+        }
+        return *this;
+    }
+
+    template <class It>
+    void assign(It first, It last) {
+        reserve(std::distance(first, last));
+        for (; first != last; ++first) push_back(*first);
+    }
+    void push_back(const T& value) {
+        if (m_size == m_capacity) reserve(2 * m_capacity);
+        new (m_data + m_size) T(value);
+        ++m_size;
+    }
+    void push_back(T&& value) {
+        if (m_size == m_capacity) reserve(2 * m_capacity);
+        new (m_data + m_size) T(std::move(value));
+        ++m_size;
+    }
+    void resize(size_t n, const T& value = T()) {
+        reserve(n);
+        while (m_size > n) m_data[--m_size].~T();
+        while (m_size < n) push_back(value);
+    }
+    void reserve(size_t n) {
+        if (n <= m_capacity) return;
+        T* data = static_cast<T*>(m_resource->allocate(n * sizeof(T), alignof(T)));
+        for (size_t i = 0; i < m_size; ++i) {
+            new (data + i) T(std::move(m_data[i]));
+            m_data[i].~T();
+        }
+        release();
+        m_data = data;
+        m_capacity = n;
+    }
+    void clear() {
+        while (m_size > 0) m_data[--m_size].~T();
+    }
+
+    size_t size() const { return m_size; }
+    size_t capacity() const { return m_capacity; }
+    bool isInline() const { return m_data == inlineData(); }
+    std::pmr::memory_resource* resource() const { return m_resource; }
+    T* data() { return m_data; }
+    const T* data() const { return m_data; }
+    T& operator[](size_t i) { return m_data[i]; }
+    const T& operator[](size_t i) const { return m_data[i]; }
+    T* begin() { return m_data; }
+    T* end() { return m_data + m_size; }
+    const T* begin() const { return m_data; }
+    const T* end() const { return m_data + m_size; }
+
+private:
+    T* inlineData() const { return reinterpret_cast<T*>(const_cast<unsigned char*>(m_inline)); }
+    void release() {
+        if (!isInline()) m_resource->deallocate(m_data, m_capacity * sizeof(T), alignof(T));
+        m_data = inlineData();
+        m_capacity = N;
+    }
+    // moves the elements (inline) or the heap buffer of other, leaves other empty
+    void take(SmallVector&& other) {
+        if (other.isInline()) {
+            for (size_t i = 0; i < other.m_size; ++i) new (m_data + i) T(std::move(other.m_data[i]));
+            m_size = other.m_size;
+            other.clear();
+            return;
+        }
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_capacity = other.m_capacity;
+        other.m_data = other.inlineData();
+        other.m_size = 0;
+        other.m_capacity = N;
+    }
+
+    std::pmr::memory_resource* m_resource = std::pmr::get_default_resource();
+    alignas(T) unsigned char m_inline[N * sizeof(T)];
+    T* m_data = inlineData();
+    size_t m_size = 0;
+    size_t m_capacity = N;
+};
+
+
+// Many edits of a plant collected first and applied at once with SolarPlant::apply: everything is validated
+// before anything changes, and the plant bookkeeping (aggregates, version) is updated once for the whole batch,
+// so caches and indices built from the plant are invalidated once instead of after every edit.
+class PlantEditBatch {
+public:
+    PlantEditBatch& setPanelSetup(const PanelSetup& setup, int index) {
+        m_edits.push_back({ Edit::Setup, index, setup, 0, 0, 0 });
+        return *this;
+    }
+    PlantEditBatch& setAngleOfaPanel(double angleInRadians, int index) {
+        m_edits.push_back({ Edit::Angle, index, PanelSetup(), angleInRadians, 0, 0 });
+        return *this;
+    }
+    PlantEditBatch& setNelementXYofaPanel(int nx, int ny, int index) {
+        m_edits.push_back({ Edit::Dimensions, index, PanelSetup(), 0, nx, ny });
+        return *this;
+    }
+    size_t size() const { return m_edits.size(); }
+    void clear() { m_edits.clear(); }
+
+private:
+    friend class SolarPlant;
+    struct Edit {
+        enum Kind { Setup, Angle, Dimensions } kind;
+        int index;
+        PanelSetup setup;
+        double angle;
+        int nx, ny;
+    };
+    std::vector<Edit> m_edits;
+};
+
+
+class PlantOutputProfile;
 
 class SolarPlant : protected PanelSetup {
 public:
@@ -128,99 +597,2710 @@ public:
     //??????????????????????????????????????????????????????????????
     // Is it possible to add array of object to constructor like in the line below?
     //SolarPlant( const PanelSetup (&setupforeach)[10]/* = PanelSetup(0, SolarPanel(20, 30))*/) : m_setups(setupforeach) {} ;
-    SolarPlant( const PanelSetup setups[10]) {
-        //loop over the arrays
+    // Yes, a std::span accepts a C array, std::array or std::vector of any length.
+    // The plant allocates from the given memory resource (an Arena for temporary plants),
+    // up to inlineSetups setups are stored inside the plant object itself.
+    explicit SolarPlant(std::span<const PanelSetup> setups, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_setups(resource), m_position(resource), m_id(resource), m_capacityPerTilt(resource) {
+        for (const PanelSetup& setup : setups) checkAngle(setup.getAngle());
+        m_setups.assign(setups.begin(), setups.end());
+        resetIds();
+        rebuildAggregates();
+    }
+    static constexpr int defaultSetups = 10; // like in the exercise
+    // nSetups default setups (defaultSetups unless said otherwise)
+    explicit SolarPlant(int nSetups, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_setups(nSetups, PanelSetup(), resource), m_position(resource), m_id(resource), m_capacityPerTilt(resource) {
+        resetIds();
+        rebuildAggregates();
+    }
+    explicit SolarPlant(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : SolarPlant(defaultSetups, resource) {}
+    // A copy is a different plant: it gets a version of its own (so caches of the source or of the plant
+    // assigned to can't mistake it for what they saw) and an empty journal starting at that version.
+    SolarPlant(const SolarPlant& other)
+        : PanelSetup(other), m_setups(other.m_setups), m_position(other.m_position), m_id(other.m_id),
+          m_journalCapacity(other.m_journalCapacity), m_totalCapacityW(other.m_totalCapacityW),
+          m_capacityPerTilt(other.m_capacityPerTilt) {}
+    SolarPlant& operator=(const SolarPlant& other) {
+        if (this == &other) return *this;
+        PanelSetup::operator=(other);
+        m_setups = other.m_setups;
+        m_position = other.m_position;
+        m_id = other.m_id;
+        m_version = nextVersion();
+        clearJournal();
+        m_journalCapacity = other.m_journalCapacity;
+        m_journalFloor = m_version;
+        m_totalCapacityW = other.m_totalCapacityW;
+        m_capacityPerTilt = other.m_capacityPerTilt;
+        std::lock_guard<std::mutex> lock(m_profileMutex);
+        m_profile.reset();
+        return *this;
+    }
+    // A move keeps the setups but leaves the source an empty plant at a new version. The target of a move
+    // assignment gets a new version as well, the journal it receives could not describe its own past.
+    SolarPlant(SolarPlant&& other) noexcept
+        : PanelSetup(other), m_setups(std::move(other.m_setups)), m_position(std::move(other.m_position)),
+          m_id(std::move(other.m_id)), m_version(other.m_version), m_journal(std::move(other.m_journal)),
+          m_journalStart(other.m_journalStart), m_journalCapacity(other.m_journalCapacity), m_journalFloor(other.m_journalFloor),
+          m_totalCapacityW(other.m_totalCapacityW), m_capacityPerTilt(std::move(other.m_capacityPerTilt)) {
+        other.resetAfterMove();
+    }
+    SolarPlant& operator=(SolarPlant&& other) {
+        if (this == &other) return *this;
+        PanelSetup::operator=(other);
+        m_setups = std::move(other.m_setups);
+        m_position = std::move(other.m_position);
+        m_id = std::move(other.m_id);
+        m_version = nextVersion();
+        clearJournal();
+        m_journalCapacity = other.m_journalCapacity;
+        m_journalFloor = m_version;
+        m_totalCapacityW = other.m_totalCapacityW;
+        m_capacityPerTilt = std::move(other.m_capacityPerTilt);
+        {
+            std::lock_guard<std::mutex> lock(m_profileMutex);
+            m_profile.reset();
+        }
+        other.resetAfterMove();
+        return *this;
     }
-    SolarPlant()=default;
+    // adds a setup at the end, returns its index
+    int addPanelSetup(const PanelSetup& setup) {
+        checkAngle(setup.getAngle());
+        m_position.push_back(size());
+        m_id.push_back(size());
+        m_setups.push_back(setup);
+        addToAggregates(setup);
+        m_version = nextVersion();
+        record(size() - 1, PanelSetup(0, SolarPanel(0, 0))); // nothing was there before, a panel of no power
+        return size() - 1;
+    }
+    // tilts have to be finite numbers (std::invalid_argument), they are the keys of capacityPerTilt()
     void setPanelSetup(const PanelSetup& setup, int index) {
-        m_setups[index] = setup;
+        checkAngle(setup.getAngle());
+        PanelSetup before = setupOf(index);
+        removeFromAggregates(setupOf(index));
+        setupOf(index) = setup;
+        addToAggregates(setupOf(index));
+        m_version = nextVersion();
+        record(index, before);
+    }
+    void setAngleOfaPanel(double angleInRadians, int index) {
+        checkAngle(angleInRadians);
+        PanelSetup before = setupOf(index);
+        removeFromAggregates(setupOf(index));
+        setupOf(index).setAngle(angleInRadians);
+        addToAggregates(setupOf(index));
+        m_version = nextVersion();
+        record(index, before);
+    }
+    // Applies all edits of the batch in order, or none of them (std::invalid_argument) if one is invalid.
+    // Small batches update the aggregates edit by edit, big ones rebuild them in one pass.
+    void apply(const PlantEditBatch& batch) {
+        for (const auto& edit : batch.m_edits) {
+            if (edit.index < 0 || edit.index >= size())
+                throw std::invalid_argument("PlantEditBatch: no setup " + to_string(edit.index));
+            bool isSetup = edit.kind == PlantEditBatch::Edit::Setup;
+            const SolarPanel& panel = edit.setup.getPanel();
+            if ((edit.kind == PlantEditBatch::Edit::Dimensions && (edit.nx < 0 || edit.ny < 0))
+                || (isSetup && (panel.nElementsX() < 0 || panel.nElementsY() < 0)))
+                throw std::invalid_argument("PlantEditBatch: negative panel dimensions");
+            if ((edit.kind == PlantEditBatch::Edit::Angle && !std::isfinite(edit.angle))
+                || (isSetup && !std::isfinite(edit.setup.getAngle())))
+                throw std::invalid_argument("PlantEditBatch: angle is not a number");
+        }
+        if (batch.size() == 0) return; // nothing changes, caches keyed by the version stay valid
+        bool rebuild = batch.size() > m_setups.size() / 8;
+        m_version = nextVersion();
+        for (const auto& edit : batch.m_edits) {
+            PanelSetup& setup = setupOf(edit.index);
+            PanelSetup before = setup;
+            if (!rebuild) removeFromAggregates(setup);
+            switch (edit.kind) {
+            case PlantEditBatch::Edit::Setup: setup = edit.setup; break;
+            case PlantEditBatch::Edit::Angle: setup.setAngle(edit.angle); break;
+            case PlantEditBatch::Edit::Dimensions: setup.getPanel().shrinkXto(edit.nx); setup.getPanel().shrinkYto(edit.ny); break;
+            }
+            if (!rebuild) addToAggregates(setup);
+            record(edit.index, before);
+        }
+        if (rebuild) rebuildAggregates();
+        Logger::log(LogLevel::Debug, "plant_batch_applied", { { "edits", double(batch.size()) }, { "version", double(m_version) } });
+    }
+    const PanelSetup& getPanelSetup(int index) const { return m_setups[m_position[index]]; }
+    int size() const { return static_cast<int>(m_setups.size()); }
+    // changes with every modification, caches built from the plant compare it to know they are stale.
+    // Versions come from one process-wide counter, no two plants (or states of a plant) share one.
+    unsigned long version() const { return m_version; }
+
+    // Journal of the last edits: which setup changed from what to what in which version
+    // (all edits of a PlantEditBatch share one version). Caches use it to update themselves
+    // instead of starting over, see ProfileCache.
+    struct JournalEntry {
+        unsigned long version;
+        int index;
+        PanelSetup before, after;
+    };
+    // Adds the edits made after the given version to `changes` (oldest first). Returns false when the
+    // journal doesn't go back that far anymore (it keeps journalCapacity() entries).
+    bool changesSince(unsigned long sinceVersion, std::vector<JournalEntry>& changes) const {
+        if (sinceVersion < m_journalFloor) return false;
+        auto first = std::find_if(m_journal.begin() + m_journalStart, m_journal.end(),
+                                  [&](const JournalEntry& entry) { return entry.version > sinceVersion; });
+        changes.insert(changes.end(), first, m_journal.end());
+        return true;
     }
+    size_t journalCapacity() const { return m_journalCapacity; }
+    void setJournalCapacity(size_t capacity) {
+        m_journalCapacity = capacity;
+        trimJournal();
+    }
+
+    // Summaries kept up to date by the mutators above, so they don't need a scan of the setups.
+    struct TiltCapacity {
+        int nSetups = 0;
+        double capacityW = 0;
+    };
+    double totalCapacityW() const { return m_totalCapacityW; }
+    // installed max power per tilt angle, sorted by tilt
+    const std::pmr::map<double, TiltCapacity>& capacityPerTilt() const { return m_capacityPerTilt; }
+    double capacityAtTiltW(double tilt) const {
+        auto it = m_capacityPerTilt.find(tilt);
+        return it == m_capacityPerTilt.end() ? 0 : it->second.capacityW;
+    }
+    // NaN for an empty plant
+    double minTilt() const { return m_capacityPerTilt.empty() ? std::numeric_limits<double>::quiet_NaN() : m_capacityPerTilt.begin()->first; }
+    double maxTilt() const { return m_capacityPerTilt.empty() ? std::numeric_limits<double>::quiet_NaN() : m_capacityPerTilt.rbegin()->first; }
     // Exercise 4
     // add the calculation of the total power produced for a given position of the source
     // it will invole iterating over PanelSetups and summing all the power
     double currentOutput(const LightSource& source) const {
         double output = 0;
-        for (int i = 0; i < 10; i++) {
-            output += m_setups[i].currentPower(LuminationAngle(m_setups[i], source));
+        double angles[64];
+        for (size_t begin = 0; begin < m_setups.size(); begin += 64) {
+            size_t n = std::min<size_t>(64, m_setups.size() - begin);
+            LuminationAngles(std::span<const PanelSetup>(m_setups.data() + begin, n), source, angles);
+            for (size_t i = 0; i < n; i++) {
+                output += m_setups[begin + i].currentPower(angles[i]);
+            }
         }
         return output;
     };
     /// This function is compileable, but doesn't work.
     void setNelementXYofaPanel(int nx, int ny, int index) {
-        m_setups[index].getPanel().shrinkXto(nx);  m_setups[index].getPanel().shrinkYto(ny);
-        cout<<m_setups[index].getPanel().areainCM2() << std::endl;
+        PanelSetup before = setupOf(index);
+        removeFromAggregates(setupOf(index));
+        setupOf(index).getPanel().shrinkXto(nx);  setupOf(index).getPanel().shrinkYto(ny);
+        addToAggregates(setupOf(index));
+        m_version = nextVersion();
+        record(index, before);
+        Logger::log(LogLevel::Debug, "plant_panel_resized", { { "index", double(index) }, { "nx", double(nx) }, { "ny", double(ny) },
+                                                             { "area_cm2", setupOf(index).getPanel().areainCM2() } });
     }
     void print() /*const*/ { 
-        for ( int i =0; i < 10; ++i)
-        std::cout << "  " << i  << " angle " << m_setups[i].getAngle() << " panel area " << m_setups[i].getPanel().areainCM2() << std::endl;
+        for ( int i =0; i < size(); ++i)
+        std::cout << "  " << i  << " angle " << setupOf(i).getAngle() << " panel area " << setupOf(i).getPanel().areainCM2() << std::endl;
+    }
+
+    // Indices used by the methods above are ids given when the setups were added, they don't change when
+    // compact() reorders the storage. The storage order is what the evaluation loops walk through.
+    std::span<const PanelSetup> storedSetups() const { return { m_setups.data(), m_setups.size() }; }
+    int idOfStored(int position) const { return m_id[position]; }
+    // Stores the setups sorted by tilt (and max power among equal tilts): runs of setups then take the same
+    // side of the tilt < 0 and cos > 0 tests and share their trig constants. The output does not change
+    // (up to the rounding of the different summation order) so the version doesn't either.
+    void compact() {
+        std::vector<int> order(m_setups.size());
+        for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<int>(i);
+        std::stable_sort(order.begin(), order.end(), [&](int l, int r) {
+            const PanelSetup& left = m_setups[l];
+            const PanelSetup& right = m_setups[r];
+            if (left.getAngle() != right.getAngle()) return left.getAngle() < right.getAngle();
+            return left.getPanel().maxPowerinW() < right.getPanel().maxPowerinW();
+        });
+        SmallVector<PanelSetup, inlineSetups> sorted(m_setups.size(), PanelSetup());
+        SmallVector<int, inlineSetups> ids(m_id.size(), 0);
+        for (size_t position = 0; position < order.size(); ++position) {
+            sorted[position] = m_setups[order[position]];
+            ids[position] = m_id[order[position]];
+            m_position[ids[position]] = static_cast<int>(position);
+        }
+        m_setups = std::move(sorted);
+        m_id = std::move(ids);
+    }
+    // Exercise 10, exact inverse queries (see PlantOutputProfile below). The profile of the last range asked
+    // for is kept until the plant changes, so repeated queries only walk its segments.
+    // sun angles in [from, to] where the output crosses the given value
+    std::vector<double> thresholdCrossings(double output, double from = -pi / 2, double to = pi / 2) const;
+    // (sun angle, output) of the maximum output in [from, to]
+    std::pair<double, double> peakOutput(double from = -pi / 2, double to = pi / 2) const;
+private:
+    struct CachedProfile;
+    std::shared_ptr<const CachedProfile> outputProfile(double from, double to) const;
+
+    PanelSetup& setupOf(int index) { return m_setups[m_position[index]]; }
+    static unsigned long nextVersion() {
+        static std::atomic<unsigned long> counter{ 0 };
+        return counter.fetch_add(1, std::memory_order_relaxed) + 1;
+    }
+    void record(int index, const PanelSetup& before) {
+        m_journal.push_back({ m_version, index, before, setupOf(index) });
+        trimJournal();
+    }
+    // the oldest entries are dropped by moving the start, the vector is shifted once half of it is dropped
+    void trimJournal() {
+        while (m_journal.size() - m_journalStart > m_journalCapacity) {
+            m_journalFloor = std::max(m_journalFloor, m_journal[m_journalStart].version);
+            ++m_journalStart;
+        }
+        if (m_journalStart > 0 && 2 * m_journalStart >= m_journal.size()) {
+            m_journal.erase(m_journal.begin(), m_journal.begin() + m_journalStart);
+            m_journalStart = 0;
+        }
+    }
+    void clearJournal() {
+        m_journal.clear();
+        m_journalStart = 0;
+    }
+    void resetAfterMove() {
+        m_setups.clear();
+        m_position.clear();
+        m_id.clear();
+        m_version = nextVersion();
+        clearJournal();
+        m_journalFloor = m_version;
+        m_totalCapacityW = 0;
+        m_capacityPerTilt.clear();
+        std::lock_guard<std::mutex> lock(m_profileMutex);
+        m_profile.reset();
     }
+    void resetIds() {
+        m_position.resize(0);
+        m_id.resize(0);
+        for (int i = 0; i < size(); ++i) { m_position.push_back(i); m_id.push_back(i); }
+    }
+
+    void addToAggregates(const PanelSetup& setup) {
+        TiltCapacity& bucket = m_capacityPerTilt[setup.getAngle()];
+        ++bucket.nSetups;
+        bucket.capacityW += setup.getPanel().maxPowerinW();
+        m_totalCapacityW += setup.getPanel().maxPowerinW();
+    }
+    static void checkAngle(double angle) {
+        if (!std::isfinite(angle)) throw std::invalid_argument("SolarPlant: angle is not a number");
+    }
+    void removeFromAggregates(const PanelSetup& setup) {
+        auto it = m_capacityPerTilt.find(setup.getAngle());
+        if (it == m_capacityPerTilt.end()) return; // can't happen with finite tilts, but never dereference end()
+        if (--it->second.nSetups == 0) m_capacityPerTilt.erase(it);
+        else it->second.capacityW -= setup.getPanel().maxPowerinW();
+        m_totalCapacityW -= setup.getPanel().maxPowerinW();
+    }
+    void rebuildAggregates() {
+        m_capacityPerTilt.clear();
+        m_totalCapacityW = 0;
+        for (const PanelSetup& setup : m_setups) addToAggregates(setup);
+    }
+
+    static constexpr size_t inlineSetups = 16;
+    SmallVector<PanelSetup, inlineSetups> m_setups; // in storage order
+    SmallVector<int, inlineSetups> m_position;       // id -> position in m_setups
+    SmallVector<int, inlineSetups> m_id;             // position in m_setups -> id
+    unsigned long m_version = nextVersion();
+    std::pmr::vector<JournalEntry> m_journal{ m_setups.resource() }; // a vector: moves can't throw (unlike a deque's)
+    size_t m_journalStart = 0;                                        // entries before it are dropped
+    size_t m_journalCapacity = 1024;
+    unsigned long m_journalFloor = m_version; // entries up to this version may have been dropped
+    double m_totalCapacityW = 0;
+    std::pmr::map<double, TiltCapacity> m_capacityPerTilt;
+    mutable std::mutex m_profileMutex; // queries may come from several threads
+    mutable std::shared_ptr<const CachedProfile> m_profile;
+};
+static_assert(std::is_nothrow_move_constructible_v<SolarPlant>, "a growing std::vector<SolarPlant> should move plants, not copy them");
+
+
+// A small fixed-size pool of worker threads shared by the heavier tools below (scenario sweeps, optimizers...).
+// parallelFor splits [0, n) into contiguous blocks so the callee can keep its inner loops tight.
+class ThreadPool {
+public:
+    // threadInit runs first on every worker thread (e.g. to pin it to some CPUs)
+    explicit ThreadPool(unsigned nthreads = std::thread::hardware_concurrency(), std::function<void()> threadInit = {}) {
+        if (nthreads == 0) nthreads = 1;
+        for (unsigned i = 0; i < nthreads; ++i)
+            m_workers.emplace_back([this, threadInit] {
+                if (threadInit) threadInit();
+                workerLoop();
+            });
+    }
+    ~ThreadPool() {
+        { std::lock_guard<std::mutex> lock(m_mutex); m_stop = true; }
+        m_wakeup.notify_all();
+        for (auto& worker : m_workers) worker.join();
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(m_workers.size()); }
+
+    // Calls fn(begin, end) on disjoint blocks covering [0, n) and returns once all of them are done.
+    // Nested calls (from inside a worker of this pool) run inline so the pool can't deadlock on itself,
+    // calls from other pools' workers are dispatched as usual. A forked process has none of the pool threads,
+    // there the calls run inline too.
+    void parallelFor(size_t n, const std::function<void(size_t, size_t)>& fn, size_t minBlock = 1) {
+        Waiter waiter;
+        dispatch(n, fn, minBlock, waiter);
+        waiter.wait();
+    }
+
+private:
+    // counts the queued blocks of one or more parallelFor-style calls until they are done
+    struct Waiter {
+        std::mutex mutex;
+        std::condition_variable done;
+        size_t pending = 0;
+        void wait() {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this] { return pending == 0; });
+        }
+    };
+
+public:
+    // parallelFor on several pools at the same time (one per NUMA node for example): start() queues the
+    // blocks on a pool and returns, wait() (or the destructor) returns once the blocks of all pools are done.
+    class Group {
+    public:
+        Group() = default;
+        Group(const Group&) = delete;
+        Group& operator=(const Group&) = delete;
+        ~Group() { wait(); }
+
+        void start(ThreadPool& pool, size_t n, std::function<void(size_t, size_t)> fn, size_t minBlock = 1) {
+            m_functions.push_back(std::move(fn)); // a deque, the queued blocks keep referring to it
+            pool.dispatch(n, m_functions.back(), minBlock, m_waiter);
+        }
+        void wait() { m_waiter.wait(); }
+
+    private:
+        std::deque<std::function<void(size_t, size_t)>> m_functions;
+        Waiter m_waiter;
+    };
+
+    static ThreadPool& instance() {
+        static ThreadPool pool;
+        return pool;
+    }
+
 private:
-    PanelSetup m_setups[10];
+    // runs fn right away (see parallelFor) or queues its blocks, counted by the waiter
+    void dispatch(size_t n, const std::function<void(size_t, size_t)>& fn, size_t minBlock, Waiter& waiter) {
+        if (n == 0) return;
+        size_t nblocks = std::min(n / std::max<size_t>(minBlock, 1) + 1, size_t(4) * size());
+        if (nblocks <= 1 || currentPool() == this || getpid() != m_pid) { fn(0, n); return; }
+        size_t blockSize = (n + nblocks - 1) / nblocks;
+        {
+            // counted before anything is queued, blocks of other pools of a Group may already be finishing
+            std::lock_guard<std::mutex> doneLock(waiter.mutex);
+            waiter.pending += (n + blockSize - 1) / blockSize;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (size_t begin = 0; begin < n; begin += blockSize) {
+                size_t end = std::min(n, begin + blockSize);
+                m_tasks.emplace_back([&fn, &waiter, begin, end] {
+                    fn(begin, end);
+                    std::lock_guard<std::mutex> doneLock(waiter.mutex);
+                    if (--waiter.pending == 0) waiter.done.notify_all();
+                });
+            }
+        }
+        m_wakeup.notify_all();
+    }
+
+    // pool whose worker the calling thread is, if any
+    static const ThreadPool*& currentPool() { thread_local const ThreadPool* pool = nullptr; return pool; }
+
+    void workerLoop() {
+        currentPool() = this;
+        for (;;) {
+            std::function<void()> task;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wakeup.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                if (m_stop && m_tasks.empty()) return;
+                task = std::move(m_tasks.front());
+                m_tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+    std::vector<std::thread> m_workers;
+    std::deque<std::function<void()>> m_tasks;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stop = false;
+    const pid_t m_pid = getpid(); // process the workers run in
 };
 
 
-int main() {
-    // For Exercise 1
-    PanelSetup testSetup(-pi / 2, SolarPanel(10, 10));
-    testSetup.setNPanel(2,3);
-    // play with methods like currentPower or efficiency to make sure they work as expected
-    cout << testSetup.currentPower(pi / 2) << "; " << testSetup.efficiency(pi) << endl;
+// Energy produced over one day: the sun travels from -pi/2 to pi/2 in daylightHours.
+// Simple midpoint rule, the result is in Wh.
+double dailyEnergyWh(const SolarPlant& plant, double daylightHours = 12, int nSteps = 64) {
+    double dAngle = pi / nSteps;
+    LightSource sun;
+    double energy = 0;
+    for (int i = 0; i < nSteps; ++i) {
+        sun.setSourceAngle(-pi / 2 + (i + 0.5) * dAngle);
+        energy += plant.currentOutput(sun);
+    }
+    return energy * daylightHours / nSteps;
+}
 
-    // For remaining exercises
-    // construct a default power plant and setup the source to change the angle from -90 to 90 (-pi/2, pi/2)
-    // and see the profile of the produced power
-    LightSource theSun;
-    theSun.setSourceAngle(-pi / 2);
-    SolarPlant powerPlant;
-    for(int i = 0; i<10; i++){
-        powerPlant.setPanelSetup(testSetup, i);
+
+// Exercise 6 (the "would it be worth investment" question from the end of main)
+// ScenarioEngine evaluates the economics of many plant designs at once.
+// A design is a tilt layout (or a tracker that always faces the sun), a panel SKU (price) and SolarPanel dimensions.
+// Annual energy only depends on the physics (layout/tracker and dimensions) so it is cached and shared by all SKUs.
+
+enum class TrackerType { Fixed, SingleAxis };
+
+struct PanelSku {
+    const char* name;
+    double costPerW; // module price
+};
+
+struct EconomicParams {
+    double pricePerkWh = 0.12;
+    double discountRate = 0.05;
+    int lifetimeYears = 25;
+    double balanceOfSystemPerW = 0.8; // mounting, inverter, wiring
+    double trackerCostPerW = 0.25;    // extra capex of the rotating mounts
+    double omPerkWYear = 15;          // operation & maintenance
+    double trackerOmPerkWYear = 5;
+    double daylightHours = 12;
+};
+
+struct DesignPoint {
+    int layout;           // index into the tilt layouts, ignored for trackers
+    TrackerType tracker;
+    int sku;              // index into the SKUs
+    int dimX, dimY;       // SolarPanel dimensions used for every setup
+};
+
+struct EconomicResult {
+    double annualEnergykWh;
+    double capex;
+    double npv;
+    double lcoe;          // per kWh
+    double paybackYears;  // undiscounted, infinity if it never pays back
+};
+
+class ScenarioEngine {
+public:
+    // every layout holds one tilt per plant slot (repeated cyclically if shorter)
+    ScenarioEngine(std::vector<std::vector<double>> tiltLayouts, std::vector<PanelSku> skus,
+                   EconomicParams params = EconomicParams(), int stepsPerDay = 64)
+        : m_layouts(std::move(tiltLayouts)), m_skus(std::move(skus)), m_params(params), m_steps(stepsPerDay) {}
+
+    double annualEnergykWh(const DesignPoint& design) {
+        auto key = std::make_tuple(design.tracker == TrackerType::Fixed ? design.layout : -1,
+                                   static_cast<int>(design.tracker), design.dimX, design.dimY);
+        {
+            std::lock_guard<std::mutex> lock(m_cacheMutex);
+            auto it = m_energyCache.find(key);
+            if (it != m_energyCache.end()) return it->second;
+        }
+        // computed outside the lock, two threads may occasionally compute the same key which is harmless
+        double energy = computeAnnualEnergykWh(design);
+        std::lock_guard<std::mutex> lock(m_cacheMutex);
+        return m_energyCache.emplace(key, energy).first->second;
     }
-    while (theSun.getSourceAngle() < pi / 2) {
-        // calculate and print out of the plant
-        // powerPlant.currentOutput( theSun );
 
-        double tmpLumi = LuminationAngle(testSetup, theSun);
-        cout << testSetup.currentPower(tmpLumi) << "; " << powerPlant.currentOutput(theSun) << endl;
-        theSun.moveSourceAngleBy(pi / 16); // move the sun a bit in each cycle
+    EconomicResult evaluate(const DesignPoint& design) {
+        const EconomicParams& p = m_params;
+        bool tracking = design.tracker != TrackerType::Fixed;
+        double capacityW = SolarPlant::defaultSetups * SolarPanel(design.dimX, design.dimY).maxPowerinW();
+        double perW = m_skus[design.sku].costPerW + p.balanceOfSystemPerW + (tracking ? p.trackerCostPerW : 0);
+        double omPerYear = capacityW / 1000 * (p.omPerkWYear + (tracking ? p.trackerOmPerkWYear : 0));
+
+        EconomicResult result;
+        result.annualEnergykWh = annualEnergykWh(design);
+        result.capex = capacityW * perW;
+        double cashPerYear = result.annualEnergykWh * p.pricePerkWh - omPerYear;
+        double discountedEnergy = 0, discountedCash = 0, discountedOm = 0, discount = 1;
+        for (int year = 1; year <= p.lifetimeYears; ++year) {
+            discount /= 1 + p.discountRate;
+            discountedEnergy += result.annualEnergykWh * discount;
+            discountedCash += cashPerYear * discount;
+            discountedOm += omPerYear * discount;
+        }
+        result.npv = discountedCash - result.capex;
+        result.lcoe = discountedEnergy > 0 ? (result.capex + discountedOm) / discountedEnergy
+                                           : std::numeric_limits<double>::infinity();
+        result.paybackYears = cashPerYear > 0 ? result.capex / cashPerYear : std::numeric_limits<double>::infinity();
+        return result;
     }
 
-    // Exercise 5
-    // The produced power depends clearly on the position of the Sun
-    // Now we would like to have a more optimal plant that produces the energy in a bit more uniform way
-    // we want to prepare (insert PanelSetups in this plant) in a special way that not all SolarPanels have the same inclination angle.
-    // Something like this below:
-    // The \_/ illustrate incidence angles and numbers 1, 2, 3 .. denote positions of the sun during the day (changing angle).
-    // At zenith (position 3) the central panels will produce most of the power and in the morning (1) the rightmost panels will produce the most power and the leftmost very little.
-    //                                3   
-    //                           2         4   
-    //                        1               5
-    //
-    //                       \ \ \ \ _ _ / / / /
-    // 
-    // construct such a plant and use it in the same kind of loop as above.
-    theSun.setSourceAngle(-pi / 2);
+    // Evaluates the whole design grid on the thread pool, results are in the order of the designs.
+    std::vector<EconomicResult> evaluateGrid(const std::vector<DesignPoint>& designs) {
+        std::vector<EconomicResult> results(designs.size());
+        ThreadPool::instance().parallelFor(designs.size(), [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) results[i] = evaluate(designs[i]);
+        }, 64);
+        return results;
+    }
 
-    
-    for (auto element : { 0,1,2,3 }) {
-        powerPlant.setPanelSetup(PanelSetup(pi / 4), element);
-        powerPlant.setNelementXYofaPanel(10,10, element); // You can put SolarPanel(x,y) inside the above PanelSetup argument intead.
+    // Cartesian product of all layouts, trackers, SKUs and dimensions (trackers are listed once, not per layout).
+    std::vector<DesignPoint> fullGrid(const std::vector<std::pair<int, int>>& dims) const {
+        std::vector<DesignPoint> grid;
+        for (int sku = 0; sku < static_cast<int>(m_skus.size()); ++sku)
+            for (const auto& d : dims) {
+                for (int layout = 0; layout < static_cast<int>(m_layouts.size()); ++layout)
+                    grid.push_back({ layout, TrackerType::Fixed, sku, d.first, d.second });
+                grid.push_back({ -1, TrackerType::SingleAxis, sku, d.first, d.second });
+            }
+        return grid;
     }
-    for (auto element : { 4,5 }) {
-        // Why PanelSetup can use only 1 argument for 2-arguments constructor? Because it was having default arguments set before. The later just overwrite them.
-        powerPlant.setPanelSetup(PanelSetup(pi / 2), element);
+
+private:
+    double computeAnnualEnergykWh(const DesignPoint& design) const {
+        SolarPanel panel(design.dimX, design.dimY);
+        if (design.tracker == TrackerType::Fixed) {
+            thread_local Arena arena;
+            arena.reset();
+            SolarPlant plant(&arena);
+            const std::vector<double>& tilts = m_layouts[design.layout];
+            for (int i = 0; i < plant.size(); ++i)
+                plant.setPanelSetup(PanelSetup(tilts[i % tilts.size()], panel), i);
+            return dailyEnergyWh(plant, m_params.daylightHours, m_steps) * 365 / 1000;
+        }
+        // the tracker keeps the panels perpendicular to the rays: tilt = sun angle + pi/2 makes the
+        // LuminationAngle 0, so every setup gives its max power at every step of the day
+        double capacityW = SolarPlant::defaultSetups * panel.maxPowerinW();
+        return capacityW * m_params.daylightHours * 365 / 1000;
     }
-    for (auto element : { 6,7,8,9 }) {
-        powerPlant.setPanelSetup(PanelSetup(-pi / 4), element);
+
+    std::vector<std::vector<double>> m_layouts;
+    std::vector<PanelSku> m_skus;
+    EconomicParams m_params;
+    int m_steps;
+    std::mutex m_cacheMutex;
+    std::map<std::tuple<int, int, int, int>, double> m_energyCache;
+};
+
+
+// Exercise 7
+// Exercise 5 trades total energy against a flat profile. Instead of tuning the layout by hand
+// LayoutOptimizer searches the tilts of all setups (NSGA-II) for three objectives at once:
+// daily energy (maximized), profile flatness (standard deviation over the day, minimized)
+// and mounting cost (tilting away from flat needs stronger mounts, minimized).
+// Every evaluated layout goes through ParetoFront, so the whole non-dominated front is available at the end.
+
+struct LayoutCandidate {
+    std::vector<double> tilts;
+    double energyWh = 0;
+    double flatness = 0;
+    double cost = 0;
+    int rank = 0;         // NSGA-II bookkeeping
+    double crowding = 0;
+};
+
+// true if a is at least as good as b in all objectives and better in one
+bool dominates(const LayoutCandidate& a, const LayoutCandidate& b) {
+    bool noWorse = a.energyWh >= b.energyWh && a.flatness <= b.flatness && a.cost <= b.cost;
+    bool better = a.energyWh > b.energyWh || a.flatness < b.flatness || a.cost < b.cost;
+    return noWorse && better;
+}
+
+// Non-dominated archive updated one candidate at a time.
+class ParetoFront {
+public:
+    // returns false (and leaves the front untouched) if the candidate is dominated or already there
+    bool insert(const LayoutCandidate& candidate) {
+        for (const auto& member : m_members)
+            if (dominates(member, candidate) || member.tilts == candidate.tilts) return false;
+        m_members.erase(std::remove_if(m_members.begin(), m_members.end(),
+                                       [&](const LayoutCandidate& member) { return dominates(candidate, member); }),
+                        m_members.end());
+        m_members.push_back(candidate);
+        return true;
     }
-    powerPlant.print();
-    // ... 
+    const std::vector<LayoutCandidate>& members() const { return m_members; }
 
-    while (theSun.getSourceAngle() < pi / 2 + pi/16) {
-        cout << "Sun position: " << theSun.getSourceAngle() << "; Current output: " << powerPlant.currentOutput(theSun) << endl;
-        theSun.moveSourceAngleBy(pi / 16); // move the sun a bit in each cycle
+private:
+    std::vector<LayoutCandidate> m_members;
+};
+
+class LayoutOptimizer {
+public:
+    // the panels (dimensions) of basePlant are kept, only their tilts are optimized within [-pi/2, pi/2]
+    LayoutOptimizer(const SolarPlant& basePlant, int nAngles = 32, unsigned seed = 1,
+                    double mountCostPerWRad = 0.1, double daylightHours = 12)
+        : m_maxPower(basePlant.size()), m_cosSun(nAngles), m_sinSun(nAngles),
+          m_mountCost(mountCostPerWRad), m_hoursPerSample(daylightHours / nAngles), m_random(seed) {
+        for (int i = 0; i < basePlant.size(); ++i) m_maxPower[i] = basePlant.getPanelSetup(i).getPanel().maxPowerinW();
+        for (int k = 0; k < nAngles; ++k) {
+            double sunAngle = -pi / 2 + (k + 0.5) * pi / nAngles;
+            m_cosSun[k] = std::cos(sunAngle);
+            m_sinSun[k] = std::sin(sunAngle);
+        }
     }
-    // All of the sudden our few classes allow to study quite interesting optimistion problem. 
-    // That is how to setup the panels to get a flat energy profile per day. 
-    // One may maybe even model how much more power can be produced if panels could rotate? Would it be worth investment ...?
 
+    // Evaluates all candidates of the batch. The profile is accumulated for all sun angles of a setup at once
+    // (a*cos + b*sin clamped at 0) so the inner loop is branch-free and vectorizes.
+    void evaluateBatch(std::vector<LayoutCandidate>& batch) const {
+        ThreadPool::instance().parallelFor(batch.size(), [&](size_t begin, size_t end) {
+            std::vector<double> profile(m_cosSun.size());
+            for (size_t c = begin; c < end; ++c) {
+                LayoutCandidate& candidate = batch[c];
+                std::fill(profile.begin(), profile.end(), 0.0);
+                candidate.cost = 0;
+                for (size_t i = 0; i < candidate.tilts.size(); ++i) {
+                    SinusoidTerm term = sinusoidTerm(candidate.tilts[i], m_maxPower[i]);
+                    for (size_t k = 0; k < profile.size(); ++k)
+                        profile[k] += std::max(0.0, term.a * m_cosSun[k] + term.b * m_sinSun[k]);
+                    candidate.cost += m_maxPower[i] * m_mountCost * (pi / 2 - std::fabs(candidate.tilts[i]));
+                }
+                double sum = 0, sum2 = 0;
+                for (double p : profile) { sum += p; sum2 += p * p; }
+                double mean = sum / profile.size();
+                candidate.energyWh = sum * m_hoursPerSample;
+                candidate.flatness = std::sqrt(std::max(0.0, sum2 / profile.size() - mean * mean));
+            }
+        }, 8);
+    }
+
+    // Runs NSGA-II; the initial population contains the extra layouts given (e.g. a hand-made one) plus random ones.
+    const ParetoFront& run(int populationSize, int generations, const std::vector<std::vector<double>>& seeds = {}) {
+        std::vector<LayoutCandidate> population;
+        for (const auto& tilts : seeds) population.push_back({ tilts });
+        while (static_cast<int>(population.size()) < populationSize) population.push_back({ randomTilts() });
+        evaluateBatch(population);
+        for (const auto& candidate : population) m_front.insert(candidate);
+        rankAndCrowd(population);
+
+        for (int generation = 0; generation < generations; ++generation) {
+            std::vector<LayoutCandidate> offspring;
+            while (offspring.size() < population.size()) {
+                const LayoutCandidate& mother = tournament(population);
+                const LayoutCandidate& father = tournament(population);
+                offspring.push_back({ crossoverAndMutate(mother.tilts, father.tilts) });
+            }
+            evaluateBatch(offspring);
+            for (const auto& candidate : offspring) m_front.insert(candidate);
+
+            population.insert(population.end(), offspring.begin(), offspring.end());
+            rankAndCrowd(population);
+            std::sort(population.begin(), population.end(), [](const LayoutCandidate& l, const LayoutCandidate& r) {
+                return l.rank != r.rank ? l.rank < r.rank : l.crowding > r.crowding;
+            });
+            population.resize(populationSize);
+        }
+        return m_front;
+    }
+
+    const ParetoFront& front() const { return m_front; }
+
+private:
+    std::vector<double> randomTilts() {
+        std::uniform_real_distribution<double> tilt(-pi / 2, pi / 2);
+        std::vector<double> tilts(m_maxPower.size());
+        for (auto& t : tilts) t = tilt(m_random);
+        return tilts;
+    }
+
+    const LayoutCandidate& tournament(const std::vector<LayoutCandidate>& population) {
+        std::uniform_int_distribution<size_t> pick(0, population.size() - 1);
+        const LayoutCandidate& l = population[pick(m_random)];
+        const LayoutCandidate& r = population[pick(m_random)];
+        if (l.rank != r.rank) return l.rank < r.rank ? l : r;
+        return l.crowding >= r.crowding ? l : r;
+    }
+
+    // uniform crossover followed by a gaussian mutation of each tilt with probability 1/nsetups
+    std::vector<double> crossoverAndMutate(const std::vector<double>& mother, const std::vector<double>& father) {
+        std::bernoulli_distribution coin(0.5), mutate(1.0 / mother.size());
+        std::normal_distribution<double> step(0, pi / 16);
+        std::vector<double> child(mother.size());
+        for (size_t i = 0; i < child.size(); ++i) {
+            child[i] = coin(m_random) ? mother[i] : father[i];
+            if (mutate(m_random)) child[i] = std::clamp(child[i] + step(m_random), -pi / 2, pi / 2);
+        }
+        return child;
+    }
+
+    // fast non-dominated sorting and crowding distance (Deb et al. 2002)
+    static void rankAndCrowd(std::vector<LayoutCandidate>& population) {
+        size_t n = population.size();
+        std::vector<std::vector<size_t>> dominatedBy(n);
+        std::vector<int> nDominating(n, 0);
+        std::vector<size_t> front;
+        for (size_t i = 0; i < n; ++i) {
+            for (size_t j = 0; j < n; ++j) {
+                if (dominates(population[i], population[j])) dominatedBy[i].push_back(j);
+                else if (dominates(population[j], population[i])) ++nDominating[i];
+            }
+            if (nDominating[i] == 0) front.push_back(i);
+        }
+        for (int rank = 0; !front.empty(); ++rank) {
+            assignCrowding(population, front);
+            std::vector<size_t> next;
+            for (size_t i : front) {
+                population[i].rank = rank;
+                for (size_t j : dominatedBy[i])
+                    if (--nDominating[j] == 0) next.push_back(j);
+            }
+            front.swap(next);
+        }
+    }
+
+    static void assignCrowding(std::vector<LayoutCandidate>& population, std::vector<size_t> front) {
+        for (size_t i : front) population[i].crowding = 0;
+        double LayoutCandidate::* objectives[] = { &LayoutCandidate::energyWh, &LayoutCandidate::flatness, &LayoutCandidate::cost };
+        for (auto objective : objectives) {
+            std::sort(front.begin(), front.end(),
+                      [&](size_t l, size_t r) { return population[l].*objective < population[r].*objective; });
+            double range = population[front.back()].*objective - population[front.front()].*objective;
+            population[front.front()].crowding = population[front.back()].crowding = std::numeric_limits<double>::infinity();
+            if (range <= 0) continue;
+            for (size_t k = 1; k + 1 < front.size(); ++k)
+                population[front[k]].crowding +=
+                    (population[front[k + 1]].*objective - population[front[k - 1]].*objective) / range;
+        }
+    }
+
+    std::vector<double> m_maxPower;
+    std::vector<double> m_cosSun, m_sinSun;
+    double m_mountCost;
+    double m_hoursPerSample;
+    std::mt19937 m_random;
+    ParetoFront m_front;
+};
+
+
+// Exercise 8
+// Installers can mount the panels only at a few fixed angles (like pi/4, pi/2 and -pi/4 in Exercise 5).
+// DiscreteTiltSolver finds the exact best assignment of the allowed tilts to the setups of a plant
+// for the "flat profile" objective: maximize the lowest output over the day (sampled at nAngles sun positions).
+// It is a branch-and-bound: the output of a partially assigned plant is bounded from above by adding,
+// at every sun angle, the best any allowed tilt could give for each unassigned setup.
+// Setups with identical panels are interchangeable, so only non-decreasing tilt choices are explored among them.
+// The top of the tree is split into subtrees explored in parallel, sharing the best solution found so far.
+
+class DiscreteTiltSolver {
+public:
+    struct Solution {
+        std::vector<double> tilts;  // one per setup of the plant, in plant order
+        double minOutput = -1;      // W, lowest output over the sampled day
+        long long nodes = 0;        // explored branch-and-bound nodes
+    };
+
+    DiscreteTiltSolver(const SolarPlant& plant, std::vector<double> allowedTilts, int nAngles = 32)
+        : m_tilts(std::move(allowedTilts)), m_nAngles(nAngles) {
+        int nSetups = plant.size();
+        // bigger panels first: their choices move the bounds the most
+        for (int i = 0; i < nSetups; ++i) m_order.push_back(i);
+        auto power = [&](int i) { return plant.getPanelSetup(i).getPanel().maxPowerinW(); };
+        std::stable_sort(m_order.begin(), m_order.end(), [&](int l, int r) { return power(l) > power(r); });
+
+        // contribution[slot][tilt][angle] and the bound of the not yet assigned suffix of slots
+        m_contribution.assign(nSetups, std::vector<std::vector<double>>(m_tilts.size(), std::vector<double>(nAngles)));
+        m_suffixBound.assign(nSetups + 1, std::vector<double>(nAngles, 0.0));
+        LightSource sun;
+        for (int slot = nSetups - 1; slot >= 0; --slot) {
+            double maxPower = power(m_order[slot]);
+            for (size_t j = 0; j < m_tilts.size(); ++j) {
+                PanelSetup setup(m_tilts[j], plant.getPanelSetup(m_order[slot]).getPanel());
+                for (int k = 0; k < nAngles; ++k) {
+                    sun.setSourceAngle(-pi / 2 + (k + 0.5) * pi / nAngles);
+                    m_contribution[slot][j][k] = setup.currentPower(LuminationAngle(setup, sun));
+                }
+            }
+            for (int k = 0; k < nAngles; ++k) {
+                double best = 0;
+                for (size_t j = 0; j < m_tilts.size(); ++j) best = std::max(best, m_contribution[slot][j][k]);
+                m_suffixBound[slot][k] = m_suffixBound[slot + 1][k] + best;
+            }
+            m_sameAsPrevious.insert(m_sameAsPrevious.begin(), slot > 0 && maxPower == power(m_order[slot - 1]));
+        }
+    }
+
+    Solution solve() {
+        int nSetups = static_cast<int>(m_order.size());
+        m_bestValue = -1;
+        m_nodes = 0;
+        m_best.assign(nSetups, 0);
+        if (m_tilts.empty() || nSetups == 0) return {};
+        greedyIncumbent();
+
+        // expand the top of the tree until there are enough subtrees to keep the pool busy
+        std::vector<std::vector<int>> subtrees = { {} };
+        size_t wanted = 4 * size_t(ThreadPool::instance().size());
+        for (int depth = 0; depth < nSetups && subtrees.size() < wanted; ++depth) {
+            std::vector<std::vector<int>> next;
+            for (const auto& prefix : subtrees)
+                for (int j = firstChoice(prefix, depth); j < static_cast<int>(m_tilts.size()); ++j) {
+                    next.push_back(prefix);
+                    next.back().push_back(j);
+                }
+            subtrees.swap(next);
+        }
+
+        ThreadPool::instance().parallelFor(subtrees.size(), [&](size_t begin, size_t end) {
+            std::vector<std::vector<double>> partial(nSetups + 1, std::vector<double>(m_nAngles, 0.0));
+            std::vector<int> choice(nSetups);
+            for (size_t s = begin; s < end; ++s) {
+                const std::vector<int>& prefix = subtrees[s];
+                for (size_t depth = 0; depth < prefix.size(); ++depth) {
+                    choice[depth] = prefix[depth];
+                    addContribution(partial[depth], depth, prefix[depth], partial[depth + 1]);
+                }
+                search(static_cast<int>(prefix.size()), partial, choice);
+            }
+        });
+
+        Solution solution;
+        solution.tilts.resize(nSetups);
+        for (int slot = 0; slot < nSetups; ++slot) solution.tilts[m_order[slot]] = m_tilts[m_best[slot]];
+        solution.minOutput = m_bestValue.load();
+        solution.nodes = m_nodes;
+        return solution;
+    }
+
+private:
+    // identical consecutive panels only take non-decreasing tilt indices (symmetry breaking)
+    int firstChoice(const std::vector<int>& choice, int depth) const {
+        return depth > 0 && m_sameAsPrevious[depth] ? choice[depth - 1] : 0;
+    }
+
+    void addContribution(const std::vector<double>& from, int slot, int tilt, std::vector<double>& to) const {
+        const std::vector<double>& add = m_contribution[slot][tilt];
+        for (int k = 0; k < m_nAngles; ++k) to[k] = from[k] + add[k];
+    }
+
+    double upperBound(const std::vector<double>& partial, int depth) const {
+        double bound = std::numeric_limits<double>::infinity();
+        for (int k = 0; k < m_nAngles; ++k) bound = std::min(bound, partial[k] + m_suffixBound[depth][k]);
+        return bound;
+    }
+
+    void search(int depth, std::vector<std::vector<double>>& partial, std::vector<int>& choice) {
+        long long nodes = 1;
+        searchNode(depth, partial, choice, nodes);
+        std::lock_guard<std::mutex> lock(m_bestMutex);
+        m_nodes += nodes;
+    }
+
+    void searchNode(int depth, std::vector<std::vector<double>>& partial, std::vector<int>& choice, long long& nodes) {
+        if (upperBound(partial[depth], depth) <= m_bestValue.load(std::memory_order_relaxed)) return;
+        if (depth == static_cast<int>(m_order.size())) {
+            double value = *std::min_element(partial[depth].begin(), partial[depth].end());
+            if (value <= m_bestValue.load(std::memory_order_relaxed)) return;
+            std::lock_guard<std::mutex> lock(m_bestMutex);
+            if (value > m_bestValue.load(std::memory_order_relaxed)) {
+                m_best = choice;
+                m_bestValue.store(value, std::memory_order_relaxed);
+            }
+            return;
+        }
+        for (int j = firstChoice(choice, depth); j < static_cast<int>(m_tilts.size()); ++j) {
+            ++nodes;
+            choice[depth] = j;
+            addContribution(partial[depth], depth, j, partial[depth + 1]);
+            searchNode(depth + 1, partial, choice, nodes);
+        }
+    }
+
+    // a quick first solution makes the pruning effective from the start
+    void greedyIncumbent() {
+        int nSetups = static_cast<int>(m_order.size());
+        std::vector<double> profile(m_nAngles, 0.0), trial(m_nAngles);
+        std::vector<int> choice(nSetups);
+        for (int slot = 0; slot < nSetups; ++slot) {
+            double bestBound = -1;
+            for (int j = firstChoice(choice, slot); j < static_cast<int>(m_tilts.size()); ++j) {
+                addContribution(profile, slot, j, trial);
+                double bound = upperBound(trial, slot + 1);
+                if (bound > bestBound) { bestBound = bound; choice[slot] = j; }
+            }
+            addContribution(profile, slot, choice[slot], trial);
+            profile.swap(trial);
+        }
+        m_bestValue = *std::min_element(profile.begin(), profile.end());
+        m_best = choice;
+    }
+
+    std::vector<double> m_tilts;
+    int m_nAngles;
+    std::vector<int> m_order;                 // slot -> index of the setup in the plant
+    std::vector<bool> m_sameAsPrevious;       // slot has the same panel as slot - 1
+    std::vector<std::vector<std::vector<double>>> m_contribution;
+    std::vector<std::vector<double>> m_suffixBound;
+
+    // the incumbent value is read lock-free by every node, the mutex is only taken to improve it
+    std::mutex m_bestMutex;
+    std::atomic<double> m_bestValue{ -1 };
+    std::vector<int> m_best;
+    long long m_nodes = 0;
+};
+
+
+// Exercise 9
+// The pi/16 steps of the loops in main() are a crude way of getting the energy of the day.
+// The output is smooth except where a setup switches on or off (its cos(incidence) crosses 0),
+// so integrateOutput cuts the sun range at those angles and integrates each smooth piece with an adaptive
+// 15 point Gauss-Kronrod rule, splitting the piece with the largest error estimate until the tolerance is met.
+
+// Sun angles in [from, to] at which the setup switches on or off. cos(LuminationAngle) = 0 with the exact pi
+// (the exercise pi is a bit short, the panels switch where the real cos changes sign).
+template <class Function>
+void forEachSwitchingAngle(const PanelSetup& setup, double from, double to, Function function) {
+    double first = setup.getAngle() < 0 ? setup.getAngle() + pi / 2 - exactPi / 2
+                                        : setup.getAngle() - pi / 2 + exactPi / 2;
+    for (double angle = first + exactPi * std::ceil((from - first) / exactPi); angle <= to; angle += exactPi)
+        if (angle > from && angle < to) function(angle);
+}
+
+std::vector<double> switchingAngles(const PanelSetup& setup, double from, double to) {
+    std::vector<double> angles;
+    forEachSwitchingAngle(setup, from, to, [&](double angle) { angles.push_back(angle); });
+    return angles;
+}
+
+// from, all switching angles of the plant and to, sorted and without duplicates
+std::vector<double> outputBreakpoints(const SolarPlant& plant, double from, double to) {
+    std::vector<double> breakpoints = { from, to };
+    for (int i = 0; i < plant.size(); ++i) {
+        std::vector<double> angles = switchingAngles(plant.getPanelSetup(i), from, to);
+        breakpoints.insert(breakpoints.end(), angles.begin(), angles.end());
+    }
+    std::sort(breakpoints.begin(), breakpoints.end());
+    breakpoints.erase(std::unique(breakpoints.begin(), breakpoints.end()), breakpoints.end());
+    return breakpoints;
+}
+
+struct IntegrationResult {
+    double value;          // W * rad
+    double errorEstimate;
+    int nEvaluations;      // currentOutput calls
+};
+
+IntegrationResult integrateOutput(const SolarPlant& plant, double from, double to, double relTol = 1e-8, int maxPieces = 2000) {
+    // Gauss-Kronrod 7/15 nodes (on [-1, 1], symmetric) and weights
+    static const double nodes[8] = { 0.991455371120812639, 0.949107912342758525, 0.864864423359769073, 0.741531185599394440,
+                                     0.586087235467691130, 0.405845151377397167, 0.207784955007898468, 0.0 };
+    static const double kronrod[8] = { 0.022935322010529225, 0.063092092629978553, 0.104790010322250184, 0.140653259715525919,
+                                       0.169004726639267903, 0.190350578064785410, 0.204432940075298892, 0.209482141084727828 };
+    static const double gauss[4] = { 0.129484966168869693, 0.279705391489276668, 0.381830050505118945, 0.417959183673469388 };
+
+    struct Piece { double from, to, value, error; };
+    int nEvaluations = 0;
+    LightSource sun;
+    auto output = [&](double angle) { ++nEvaluations; sun.setSourceAngle(angle); return plant.currentOutput(sun); };
+    auto integrate = [&](double a, double b) {
+        double center = (a + b) / 2, half = (b - a) / 2;
+        double fc = output(center);
+        double k = fc * kronrod[7], g = fc * gauss[3];
+        for (int j = 0; j < 7; ++j) {
+            double f = output(center - half * nodes[j]) + output(center + half * nodes[j]);
+            k += kronrod[j] * f;
+            if (j % 2 == 1) g += gauss[j / 2] * f;
+        }
+        return Piece{ a, b, k * half, std::fabs((k - g) * half) };
+    };
+
+    auto largerError = [](const Piece& l, const Piece& r) { return l.error < r.error; };
+    std::vector<Piece> pieces; // kept as a max-heap on the error
+    std::vector<double> breakpoints = outputBreakpoints(plant, from, to);
+    for (size_t i = 0; i + 1 < breakpoints.size(); ++i) pieces.push_back(integrate(breakpoints[i], breakpoints[i + 1]));
+    std::make_heap(pieces.begin(), pieces.end(), largerError);
+
+    auto totals = [&] {
+        double value = 0, error = 0;
+        for (const Piece& piece : pieces) { value += piece.value; error += piece.error; }
+        return std::make_pair(value, error);
+    };
+    auto [value, error] = totals();
+    while (!pieces.empty() && error > relTol * std::fabs(value) && static_cast<int>(pieces.size()) < maxPieces) {
+        std::pop_heap(pieces.begin(), pieces.end(), largerError);
+        Piece worst = pieces.back();
+        pieces.pop_back();
+        double middle = (worst.from + worst.to) / 2;
+        for (const Piece& half : { integrate(worst.from, middle), integrate(middle, worst.to) }) {
+            pieces.push_back(half);
+            std::push_heap(pieces.begin(), pieces.end(), largerError);
+        }
+        std::tie(value, error) = totals(); // re-summed to avoid cancellation drift
+    }
+    return { value, error, nEvaluations };
+}
+
+// Same as dailyEnergyWh but integrated to a relative tolerance instead of a fixed number of steps.
+double integratedDailyEnergyWh(const SolarPlant& plant, double daylightHours = 12, double relTol = 1e-8) {
+    return integrateOutput(plant, -pi / 2, pi / 2, relTol).value * daylightHours / pi;
+}
+
+
+// Parallel building blocks of the PlantOutputProfile index (plants with 10^8 setups need them).
+
+// bits of a double that sort like the value (NaN aside): flip all bits of negatives, only the sign of positives
+inline uint64_t orderedKey(double value) {
+    uint64_t bits = std::bit_cast<uint64_t>(value);
+    return bits >> 63 ? ~bits : bits | (uint64_t(1) << 63);
+}
+
+// Stable LSD radix sort of the keys (8 bits per pass), values are moved along.
+// Every block of the arrays is counted and scattered by its own task, passes where all keys share the digit are skipped.
+void parallelRadixSort(std::vector<uint64_t>& keys, std::vector<uint32_t>& values) {
+    size_t n = keys.size();
+    ThreadPool& pool = ThreadPool::instance();
+    size_t nBlocks = std::clamp<size_t>(n / 65536, 1, 4 * size_t(pool.size()));
+    size_t blockSize = (n + nBlocks - 1) / nBlocks;
+    std::vector<uint64_t> keyBuffer(n);
+    std::vector<uint32_t> valueBuffer(n);
+    std::vector<size_t> offsets(nBlocks * 256);
+    for (int shift = 0; shift < 64; shift += 8) {
+        std::fill(offsets.begin(), offsets.end(), 0);
+        pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+            for (size_t block = first; block < last; ++block)
+                for (size_t i = block * blockSize; i < std::min(n, (block + 1) * blockSize); ++i)
+                    ++offsets[block * 256 + ((keys[i] >> shift) & 0xff)];
+        });
+        // counts -> where every (digit, block) starts writing
+        size_t start = 0;
+        bool allSame = false;
+        for (size_t digit = 0; digit < 256 && !allSame; ++digit) {
+            for (size_t block = 0; block < nBlocks; ++block) {
+                size_t count = offsets[block * 256 + digit];
+                offsets[block * 256 + digit] = start;
+                start += count;
+            }
+            allSame = start == n && offsets[digit] == 0;
+        }
+        if (allSame) continue;
+        pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+            for (size_t block = first; block < last; ++block)
+                for (size_t i = block * blockSize; i < std::min(n, (block + 1) * blockSize); ++i) {
+                    size_t destination = offsets[block * 256 + ((keys[i] >> shift) & 0xff)]++;
+                    keyBuffer[destination] = keys[i];
+                    valueBuffer[destination] = values[i];
+                }
+        });
+        keys.swap(keyBuffer);
+        values.swap(valueBuffer);
+    }
+}
+
+// Inclusive prefix sums of both arrays in place: the blocks are summed in parallel,
+// the block totals are scanned, then every block is scanned starting from its offset.
+void parallelPrefixSum(std::vector<double>& a, std::vector<double>& b) {
+    size_t n = a.size();
+    ThreadPool& pool = ThreadPool::instance();
+    size_t nBlocks = std::clamp<size_t>(n / 65536, 1, 4 * size_t(pool.size()));
+    size_t blockSize = (n + nBlocks - 1) / nBlocks;
+    std::vector<double> offsetA(nBlocks + 1, 0.0), offsetB(nBlocks + 1, 0.0);
+    pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+        for (size_t block = first; block < last; ++block)
+            for (size_t i = block * blockSize; i < std::min(n, (block + 1) * blockSize); ++i) {
+                offsetA[block + 1] += a[i];
+                offsetB[block + 1] += b[i];
+            }
+    });
+    for (size_t block = 0; block < nBlocks; ++block) {
+        offsetA[block + 1] += offsetA[block];
+        offsetB[block + 1] += offsetB[block];
+    }
+    pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+        for (size_t block = first; block < last; ++block) {
+            double sumA = offsetA[block], sumB = offsetB[block];
+            for (size_t i = block * blockSize; i < std::min(n, (block + 1) * blockSize); ++i) {
+                a[i] = sumA += a[i];
+                b[i] = sumB += b[i];
+            }
+        }
+    });
+}
+
+
+// Exercise 10
+// "When does the output exceed X?" and "when is the peak?" without sampling.
+// Between two switching angles the set of producing setups does not change, so the plant output
+// is exactly A*cos(sunAngle) + B*sin(sunAngle) there (the sum of the sinusoidTerm of the producing setups).
+// PlantOutputProfile keeps the sorted switching angles and (A, B) of every segment in between.
+// Evaluation is a binary search, crossings and the peak are solved in closed form per segment.
+
+class PlantOutputProfile {
+public:
+    struct Crossing {
+        double sunAngle;
+        bool rising;     // output goes above the threshold here
+    };
+
+    PlantOutputProfile(const SolarPlant& plant, double from = -pi / 2, double to = pi / 2) {
+        ThreadPool& pool = ThreadPool::instance();
+        std::span<const PanelSetup> setups = plant.storedSetups();
+
+        // Every switching angle adds (switch on) or removes (switch off) the term of its setup.
+        // Events are collected per block of setups, then concatenated.
+        size_t nBlocks = std::clamp<size_t>(setups.size() / 16384, 1, 4 * size_t(pool.size()));
+        size_t blockSize = (setups.size() + nBlocks - 1) / nBlocks;
+        struct Block { std::vector<double> angles, a, b; double a0 = 0, b0 = 0; };
+        std::vector<Block> blocks(nBlocks);
+        pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+            for (size_t index = first; index < last; ++index) {
+                Block& block = blocks[index];
+                for (size_t i = index * blockSize; i < std::min(setups.size(), (index + 1) * blockSize); ++i) {
+                    SinusoidTerm term = sinusoidTerm(setups[i]);
+                    if (isOn(term, from)) { block.a0 += term.a; block.b0 += term.b; }
+                    forEachSwitchingAngle(setups[i], from, to, [&](double angle) {
+                        double sign = -term.a * std::sin(angle) + term.b * std::cos(angle) > 0 ? 1 : -1; // switching on if rising
+                        block.angles.push_back(angle);
+                        block.a.push_back(sign * term.a);
+                        block.b.push_back(sign * term.b);
+                    });
+                }
+            }
+        });
+        std::vector<size_t> firstEvent(nBlocks + 1, 0);
+        double a0 = 0, b0 = 0;
+        for (size_t index = 0; index < nBlocks; ++index) {
+            firstEvent[index + 1] = firstEvent[index] + blocks[index].angles.size();
+            a0 += blocks[index].a0;
+            b0 += blocks[index].b0;
+        }
+        size_t nEvents = firstEvent[nBlocks];
+        std::vector<double> angles(nEvents), a(nEvents), b(nEvents);
+        std::vector<uint64_t> keys(nEvents);
+        std::vector<uint32_t> order(nEvents);
+        pool.parallelFor(nBlocks, [&](size_t first, size_t last) {
+            for (size_t index = first; index < last; ++index) {
+                const Block& block = blocks[index];
+                for (size_t j = 0; j < block.angles.size(); ++j) {
+                    size_t event = firstEvent[index] + j;
+                    angles[event] = block.angles[j];
+                    a[event] = block.a[j];
+                    b[event] = block.b[j];
+                    keys[event] = orderedKey(block.angles[j]);
+                    order[event] = static_cast<uint32_t>(event);
+                }
+            }
+        });
+        blocks.clear();
+
+        // sort by angle, then the running sums of the events give the coefficients after every event
+        parallelRadixSort(keys, order);
+        std::vector<double> sortedA(nEvents), sortedB(nEvents);
+        pool.parallelFor(nEvents, [&](size_t first, size_t last) {
+            for (size_t event = first; event < last; ++event) {
+                sortedA[event] = a[order[event]];
+                sortedB[event] = b[order[event]];
+            }
+        }, 65536);
+        if (nEvents > 0) { sortedA[0] += a0; sortedB[0] += b0; }
+        parallelPrefixSum(sortedA, sortedB);
+
+        // events at the same angle make one breakpoint, the segment starts after the last of them
+        m_breakpoints.push_back(from);
+        m_a.push_back(a0);
+        m_b.push_back(b0);
+        for (size_t event = 0; event < nEvents; ++event) {
+            double angle = angles[order[event]];
+            if (angle > m_breakpoints.back()) {
+                m_breakpoints.push_back(angle);
+                m_a.push_back(0);
+                m_b.push_back(0);
+            }
+            m_a.back() = sortedA[event];
+            m_b.back() = sortedB[event];
+        }
+        m_breakpoints.push_back(to);
+    }
+
+    double from() const { return m_breakpoints.front(); }
+    double to() const { return m_breakpoints.back(); }
+    size_t nSegments() const { return m_a.size(); }
+    double segmentStart(size_t segment) const { return m_breakpoints[segment]; }
+    double segmentEnd(size_t segment) const { return m_breakpoints[segment + 1]; }
+    double segmentAmplitude(size_t segment) const { return std::hypot(m_a[segment], m_b[segment]); }
+    // the smooth formula of a segment, also valid a bit outside of it
+    double segmentOutput(size_t segment, double sunAngle) const {
+        return m_a[segment] * std::cos(sunAngle) + m_b[segment] * std::sin(sunAngle);
+    }
+
+    double output(double sunAngle) const {
+        size_t segment = segmentOf(sunAngle);
+        return std::max(0.0, m_a[segment] * std::cos(sunAngle) + m_b[segment] * std::sin(sunAngle));
+    }
+
+    // all sun angles where the output crosses the given value, in increasing order
+    std::vector<Crossing> crossings(double threshold) const {
+        std::vector<Crossing> result;
+        for (size_t segment = 0; segment < nSegments(); ++segment) {
+            double amplitude = std::hypot(m_a[segment], m_b[segment]);
+            if (amplitude <= 0 || std::fabs(threshold) > amplitude) continue;
+            double phase = std::atan2(m_b[segment], m_a[segment]); // output = amplitude * cos(angle - phase)
+            double offset = std::acos(threshold / amplitude);
+            std::vector<Crossing> found;
+            for (double root : { phase - offset, phase + offset })
+                for (double angle : periodicIn(root, segment))
+                    found.push_back({ angle, -m_a[segment] * std::sin(angle) + m_b[segment] * std::cos(angle) > 0 });
+            std::sort(found.begin(), found.end(), [](const Crossing& l, const Crossing& r) { return l.sunAngle < r.sunAngle; });
+            result.insert(result.end(), found.begin(), found.end());
+        }
+        return result;
+    }
+
+    // sun angle intervals where the output is above the threshold
+    std::vector<std::pair<double, double>> intervalsAbove(double threshold) const {
+        std::vector<std::pair<double, double>> intervals;
+        bool above = output(from()) > threshold;
+        double start = from();
+        for (const Crossing& crossing : crossings(threshold)) {
+            if (crossing.rising && !above) { start = crossing.sunAngle; above = true; }
+            else if (!crossing.rising && above) { intervals.emplace_back(start, crossing.sunAngle); above = false; }
+        }
+        if (above) intervals.emplace_back(start, to());
+        return intervals;
+    }
+
+    // (sun angle, output) of the maximum output over the range
+    std::pair<double, double> peak() const {
+        std::pair<double, double> best(from(), -1);
+        for (size_t segment = 0; segment < nSegments(); ++segment) {
+            std::vector<double> candidates = { m_breakpoints[segment], m_breakpoints[segment + 1] };
+            for (double angle : periodicIn(std::atan2(m_b[segment], m_a[segment]), segment)) candidates.push_back(angle);
+            for (double angle : candidates) {
+                double value = std::max(0.0, m_a[segment] * std::cos(angle) + m_b[segment] * std::sin(angle));
+                if (value > best.second) best = { angle, value };
+            }
+        }
+        return best;
+    }
+
+private:
+    static bool isOn(const SinusoidTerm& term, double angle) {
+        double value = term.a * std::cos(angle) + term.b * std::sin(angle);
+        double slope = -term.a * std::sin(angle) + term.b * std::cos(angle);
+        return value > 0 || (value == 0 && slope > 0);
+    }
+
+    size_t segmentOf(double sunAngle) const {
+        size_t segment = std::upper_bound(m_breakpoints.begin(), m_breakpoints.end(), sunAngle) - m_breakpoints.begin();
+        return std::min(segment == 0 ? 0 : segment - 1, nSegments() - 1);
+    }
+
+    // angle + 2k*pi falling in [start, end) of the segment (the last segment includes its end)
+    std::vector<double> periodicIn(double angle, size_t segment) const {
+        double start = m_breakpoints[segment], end = m_breakpoints[segment + 1];
+        bool last = segment + 1 == nSegments();
+        std::vector<double> angles;
+        for (double a = angle + 2 * exactPi * std::ceil((start - angle) / (2 * exactPi)); a < end || (last && a == end); a += 2 * exactPi)
+            angles.push_back(a);
+        return angles;
+    }
+
+    std::vector<double> m_breakpoints; // nSegments() + 1 sorted angles from from() to to()
+    std::vector<double> m_a, m_b;      // output = a*cos + b*sin within each segment
+};
+
+struct SolarPlant::CachedProfile {
+    CachedProfile(const SolarPlant& plant, double first, double last)
+        : version(plant.version()), from(first), to(last), profile(plant, first, last) {}
+    const std::pair<double, double>& peak() const {
+        std::call_once(peakOnce, [this] { peakValue = profile.peak(); });
+        return peakValue;
+    }
+
+    unsigned long version;
+    double from, to;
+    PlantOutputProfile profile;
+    mutable std::once_flag peakOnce;
+    mutable std::pair<double, double> peakValue;
+};
+
+std::shared_ptr<const SolarPlant::CachedProfile> SolarPlant::outputProfile(double from, double to) const {
+    std::lock_guard<std::mutex> lock(m_profileMutex);
+    if (!m_profile || m_profile->version != m_version || m_profile->from != from || m_profile->to != to)
+        m_profile = std::make_shared<const CachedProfile>(*this, from, to);
+    return m_profile;
+}
+
+std::vector<double> SolarPlant::thresholdCrossings(double output, double from, double to) const {
+    std::vector<double> angles;
+    for (const auto& crossing : outputProfile(from, to)->profile.crossings(output)) angles.push_back(crossing.sunAngle);
+    return angles;
+}
+
+std::pair<double, double> SolarPlant::peakOutput(double from, double to) const {
+    return outputProfile(from, to)->peak();
+}
+
+
+// Exercise 11
+// Control loops need the output at arbitrary sun angles very quickly.
+// OutputSurrogate fits a Chebyshev polynomial on each smooth piece of the output (the segments of PlantOutputProfile,
+// halved until the degree stays small) and evaluates it with the Clenshaw recurrence.
+// Within a segment the output is amplitude * cos(angle - phase), all its derivatives are bounded by the amplitude,
+// which gives a guaranteed interpolation error bound: amplitude * (h/2)^(n+1) / (2^n (n+1)!) for degree n on width h.
+// The surrogate remembers the plant version it was fitted to and refits itself on the first query after a change.
+// Queries may come from several threads (the refit is locked), but not while the plant is being modified.
+
+class OutputSurrogate {
+public:
+    static constexpr int maxDegree = 15;
+
+    OutputSurrogate(const SolarPlant& plant, double maxError = 1e-6, double from = -pi / 2, double to = pi / 2)
+        : m_plant(plant), m_maxError(maxError), m_from(from), m_to(to) {}
+
+    double maxErrorBound() const { refresh(); return m_errorBound; }
+    size_t nPieces() const { refresh(); return m_starts.size(); }
+
+    double output(double sunAngle) const {
+        refresh();
+        return clenshaw(pieceOf(sunAngle), sunAngle);
+    }
+
+    // Evaluates many angles at once. All pieces share the same (zero padded) degree,
+    // so the recurrence runs in lock-step over a block of angles and the compiler can vectorize it.
+    void output(std::span<const double> sunAngles, std::span<double> outputs) const {
+        refresh();
+        constexpr size_t block = 8;
+        for (size_t begin = 0; begin < sunAngles.size(); begin += block) {
+            size_t n = std::min(block, sunAngles.size() - begin);
+            size_t piece[block];
+            double x[block], b1[block] = {}, b2[block] = {};
+            for (size_t lane = 0; lane < n; ++lane) {
+                piece[lane] = pieceOf(sunAngles[begin + lane]) * (maxDegree + 1);
+                x[lane] = scaled(piece[lane] / (maxDegree + 1), sunAngles[begin + lane]);
+            }
+            for (int j = maxDegree; j >= 1; --j)
+                for (size_t lane = 0; lane < n; ++lane) {
+                    double b0 = m_coefficients[piece[lane] + j] + 2 * x[lane] * b1[lane] - b2[lane];
+                    b2[lane] = b1[lane];
+                    b1[lane] = b0;
+                }
+            for (size_t lane = 0; lane < n; ++lane)
+                outputs[begin + lane] = m_coefficients[piece[lane]] + x[lane] * b1[lane] - b2[lane];
+        }
+    }
+
+private:
+    void refresh() const {
+        if (m_fittedVersion.load(std::memory_order_acquire) == m_plant.version()) return;
+        std::lock_guard<std::mutex> lock(m_fitMutex);
+        if (m_fittedVersion.load(std::memory_order_relaxed) == m_plant.version()) return; // fitted by another thread meanwhile
+        m_starts.clear();
+        m_widths.clear();
+        m_coefficients.clear();
+        m_errorBound = 0;
+        PlantOutputProfile profile(m_plant, m_from, m_to);
+        for (size_t segment = 0; segment < profile.nSegments(); ++segment)
+            fit(profile, segment, profile.segmentStart(segment), profile.segmentEnd(segment));
+        m_fittedVersion.store(m_plant.version(), std::memory_order_release);
+    }
+
+    // lowest degree meeting the error bound, the interval is halved when even maxDegree is not enough
+    void fit(const PlantOutputProfile& profile, size_t segment, double start, double end) const {
+        double amplitude = profile.segmentAmplitude(segment);
+        double halfWidth = (end - start) / 2, bound = amplitude;
+        int degree = 0;
+        for (; degree <= maxDegree; ++degree) {
+            bound *= halfWidth / (degree + 1) / (degree > 0 ? 2 : 1); // amplitude * (h/2)^(n+1) / (2^n (n+1)!)
+            if (bound <= m_maxError) break;
+        }
+        if (degree > maxDegree) {
+            double middle = (start + end) / 2;
+            fit(profile, segment, start, middle);
+            fit(profile, segment, middle, end);
+            return;
+        }
+        // interpolation at the n+1 Chebyshev nodes, coefficients by the discrete cosine transform
+        int n = degree + 1;
+        std::vector<double> values(n);
+        for (int k = 0; k < n; ++k) {
+            double x = std::cos(exactPi * (k + 0.5) / n);
+            values[k] = profile.segmentOutput(segment, start + (x + 1) * halfWidth);
+        }
+        m_starts.push_back(start);
+        m_widths.push_back(end - start);
+        for (int j = 0; j <= maxDegree; ++j) {
+            double c = 0;
+            if (j < n)
+                for (int k = 0; k < n; ++k) c += values[k] * std::cos(exactPi * j * (k + 0.5) / n);
+            m_coefficients.push_back(j < n ? c * (j == 0 ? 1.0 : 2.0) / n : 0.0);
+        }
+        m_errorBound = std::max(m_errorBound, bound);
+    }
+
+    size_t pieceOf(double sunAngle) const {
+        size_t piece = std::upper_bound(m_starts.begin(), m_starts.end(), sunAngle) - m_starts.begin();
+        return piece == 0 ? 0 : piece - 1;
+    }
+
+    double scaled(size_t piece, double sunAngle) const { return 2 * (sunAngle - m_starts[piece]) / m_widths[piece] - 1; }
+
+    double clenshaw(size_t piece, double sunAngle) const {
+        const double* c = &m_coefficients[piece * (maxDegree + 1)];
+        double x = scaled(piece, sunAngle), b1 = 0, b2 = 0;
+        for (int j = maxDegree; j >= 1; --j) {
+            double b0 = c[j] + 2 * x * b1 - b2;
+            b2 = b1;
+            b1 = b0;
+        }
+        return c[0] + x * b1 - b2;
+    }
+
+    const SolarPlant& m_plant;
+    double m_maxError, m_from, m_to;
+    // fitted lazily from const queries, plant versions start at 1 so 0 means not fitted yet
+    mutable std::mutex m_fitMutex;
+    mutable std::atomic<unsigned long> m_fittedVersion{ 0 };
+    mutable double m_errorBound = 0;
+    mutable std::vector<double> m_starts, m_widths;
+    mutable std::vector<double> m_coefficients; // (maxDegree + 1) per piece
+};
+
+
+// Exercise 12
+// Design tools ask over and over what a panel at a given tilt produces at a given sun angle.
+// PowerTable precomputes it on a (tilt x sun angle) grid. The power of a setup is its max power times
+// max(0, cos(incidence)), so one table of relative output serves every SolarPanel size.
+// A plant profile is then just the sum of the (scaled) rows of its tilts.
+// Tables are built on the thread pool and can be saved/loaded so they don't have to be rebuilt.
+
+class PowerTable {
+public:
+    // at least 2 tilts and 2 sun angles (std::invalid_argument otherwise), the grids include both ends
+    PowerTable(int nTilts, int nSunAngles, double fromSun = -pi / 2, double toSun = pi / 2)
+        : m_nTilts(checkedSize(nTilts)), m_nSun(checkedSize(nSunAngles)), m_fromSun(fromSun), m_toSun(toSun),
+          m_relative(size_t(nTilts) * nSunAngles) {
+        ThreadPool::instance().parallelFor(m_nTilts, [&](size_t begin, size_t end) {
+            LightSource sun;
+            for (size_t row = begin; row < end; ++row) {
+                PanelSetup setup(tiltOf(static_cast<int>(row)), SolarPanel(1, 1));
+                for (int k = 0; k < m_nSun; ++k) {
+                    sun.setSourceAngle(sunAngleOf(k));
+                    m_relative[row * m_nSun + k] = setup.currentPower(LuminationAngle(setup, sun)) / setup.getPanel().maxPowerinW();
+                }
+            }
+        });
+    }
+
+    int nTilts() const { return m_nTilts; }
+    int nSunAngles() const { return m_nSun; }
+    double tiltOf(int row) const { return -pi / 2 + row * pi / (m_nTilts - 1); }
+    double sunAngleOf(int column) const { return m_fromSun + column * (m_toSun - m_fromSun) / (m_nSun - 1); }
+    // LuminationAngle switches formulas at tilt 0 (the panel faces the other way), so the row is
+    // the nearest one on the same side of zero as the tilt
+    int nearestRow(double tilt) const {
+        int row = std::clamp(static_cast<int>(std::lround((tilt + pi / 2) / pi * (m_nTilts - 1))), 0, m_nTilts - 1);
+        if ((tiltOf(row) < 0) != (tilt < 0)) row += tilt < 0 ? -1 : 1; // the first and last rows are on their own side
+        return row;
+    }
+
+    double power(const PanelSetup& setup, int column) const {
+        return setup.getPanel().maxPowerinW() * m_relative[size_t(nearestRow(setup.getAngle())) * m_nSun + column];
+    }
+
+    // output of the plant at every sun angle of the table (tilts rounded to the nearest row)
+    std::vector<double> profile(const SolarPlant& plant) const {
+        std::vector<double> output(m_nSun, 0.0);
+        for (int i = 0; i < plant.size(); ++i) {
+            const PanelSetup& setup = plant.getPanelSetup(i);
+            const double* row = &m_relative[size_t(nearestRow(setup.getAngle())) * m_nSun];
+            double maxPower = setup.getPanel().maxPowerinW();
+            for (int k = 0; k < m_nSun; ++k) output[k] += maxPower * row[k];
+        }
+        return output;
+    }
+
+    void save(const std::string& path) const {
+        std::ofstream file(path, std::ios::binary);
+        file.write(magic, sizeof(magic));
+        file.write(reinterpret_cast<const char*>(&m_nTilts), sizeof(m_nTilts));
+        file.write(reinterpret_cast<const char*>(&m_nSun), sizeof(m_nSun));
+        file.write(reinterpret_cast<const char*>(&m_fromSun), sizeof(m_fromSun));
+        file.write(reinterpret_cast<const char*>(&m_toSun), sizeof(m_toSun));
+        file.write(reinterpret_cast<const char*>(m_relative.data()), m_relative.size() * sizeof(double));
+        if (!file) throw std::runtime_error("PowerTable: cannot write " + path);
+    }
+
+    static PowerTable load(const std::string& path) {
+        std::ifstream file(path, std::ios::binary);
+        char header[sizeof(magic)] = {};
+        file.read(header, sizeof(header));
+        if (!file || !std::equal(header, header + sizeof(magic), magic))
+            throw std::runtime_error("PowerTable: " + path + " is not a power table");
+        PowerTable table;
+        file.read(reinterpret_cast<char*>(&table.m_nTilts), sizeof(table.m_nTilts));
+        file.read(reinterpret_cast<char*>(&table.m_nSun), sizeof(table.m_nSun));
+        file.read(reinterpret_cast<char*>(&table.m_fromSun), sizeof(table.m_fromSun));
+        file.read(reinterpret_cast<char*>(&table.m_toSun), sizeof(table.m_toSun));
+        if (!file || table.m_nTilts < 2 || table.m_nSun < 2) throw std::runtime_error("PowerTable: bad header in " + path);
+        table.m_relative.resize(size_t(table.m_nTilts) * table.m_nSun);
+        file.read(reinterpret_cast<char*>(table.m_relative.data()), table.m_relative.size() * sizeof(double));
+        if (!file) throw std::runtime_error("PowerTable: " + path + " is truncated");
+        return table;
+    }
+
+private:
+    PowerTable() = default;
+    static int checkedSize(int n) {
+        if (n < 2) throw std::invalid_argument("PowerTable: needs at least 2 tilts and 2 sun angles");
+        return n;
+    }
+    static constexpr char magic[8] = { 'S', 'P', 'T', 'A', 'B', 'L', 'E', '1' };
+
+    int m_nTilts = 0, m_nSun = 0;
+    double m_fromSun = 0, m_toSun = 0;
+    std::vector<double> m_relative; // row per tilt, max(0, cos(incidence))
+};
+
+
+// Exercise 13 and 14
+// For a fixed installation the layout is known when the controller is compiled.
+// FixedSolarPlant takes it as a template argument: the sinusoidTerm of every setup is computed by the compiler
+// and currentOutput is an unrolled sum of max(0, a*cos + b*sin), one cos and one sin per call and no branches.
+// The whole model (SolarPanel, PanelSetup, LightSource, LuminationAngle) is constexpr, so the daily profile
+// of such a plant can be baked into a static table at compile time (profile below).
+
+struct FixedSetup {
+    double tilt;
+    int dimX, dimY;
+};
+
+template <size_t N, const std::array<FixedSetup, N>& Layout>
+class FixedSolarPlant {
+public:
+    static constexpr size_t size() { return N; }
+
+    static constexpr double currentOutput(double sunAngle) {
+        double c = constexprCos(sunAngle), s = constexprSin(sunAngle);
+        return [&]<size_t... I>(std::index_sequence<I...>) {
+            return (0.0 + ... + positivePart(terms[I].a * c + terms[I].b * s));
+        }(std::make_index_sequence<N>());
+    }
+    static constexpr double currentOutput(const LightSource& source) { return currentOutput(source.getSourceAngle()); }
+
+    // Output at Steps sun positions from `from` in steps of `step` (the sweep of main() by default).
+    // Used as the initializer of a constexpr variable it is computed entirely by the compiler.
+    template <size_t Steps>
+    static constexpr std::array<double, Steps> profile(double from = -pi / 2, double step = pi / 16) {
+        std::array<double, Steps> result{};
+        LightSource sun(from);
+        for (size_t k = 0; k < Steps; ++k, sun.moveSourceAngleBy(step)) {
+            for (const FixedSetup& fixed : Layout) {
+                PanelSetup setup(fixed.tilt, SolarPanel(fixed.dimX, fixed.dimY));
+                result[k] += setup.currentPower(LuminationAngle(setup, sun));
+            }
+        }
+        return result;
+    }
+
+    // the equivalent run-time plant
+    static SolarPlant toSolarPlant() {
+        SolarPlant plant(0);
+        for (const FixedSetup& setup : Layout) plant.addPanelSetup(PanelSetup(setup.tilt, SolarPanel(setup.dimX, setup.dimY)));
+        return plant;
+    }
+
+private:
+    // max(x, 0) by clearing all bits of negative numbers (the sign bit smeared by the shift), compilers turn the
+    // usual comparison into a jump here
+    static constexpr double positivePart(double x) {
+        int64_t bits = std::bit_cast<int64_t>(x);
+        return std::bit_cast<double>(bits & ~(bits >> 63));
+    }
+    static constexpr std::array<SinusoidTerm, N> makeTerms() {
+        std::array<SinusoidTerm, N> result{};
+        for (size_t i = 0; i < N; ++i)
+            result[i] = sinusoidTerm(Layout[i].tilt, SolarPanel(Layout[i].dimX, Layout[i].dimY).maxPowerinW());
+        return result;
+    }
+    static constexpr std::array<SinusoidTerm, N> terms = makeTerms();
+};
+
+// the \ \ \ \ _ _ / / / / plant of Exercise 5
+constexpr std::array<FixedSetup, 10> exercise5Layout = { { { pi / 4, 10, 10 }, { pi / 4, 10, 10 }, { pi / 4, 10, 10 }, { pi / 4, 10, 10 },
+                                                           { pi / 2, 20, 30 }, { pi / 2, 20, 30 },
+                                                           { -pi / 4, 20, 30 }, { -pi / 4, 20, 30 }, { -pi / 4, 20, 30 }, { -pi / 4, 20, 30 } } };
+using Exercise5Plant = FixedSolarPlant<10, exercise5Layout>;
+
+
+// Exercise 15
+// Plants too big for the memory. A plant file is a short header followed by one fixed-size record per setup.
+// StreamingPlantEvaluator reads it in big chunks, the next chunk is read by a background thread while the
+// current one is evaluated on the thread pool, and each chunk is evaluated for all requested sun angles at once,
+// so the file is read once per batch of angles.
+
+struct PlantFileRecord {
+    double tilt;
+    int32_t nElementsX, nElementsY;
+};
+static_assert(sizeof(PlantFileRecord) == 16, "plant files rely on packed 16 byte records");
+constexpr char plantFileMagic[8] = { 'S', 'P', 'P', 'L', 'A', 'N', 'T', '1' };
+
+void savePlant(const SolarPlant& plant, const std::string& path) {
+    std::ofstream file(path, std::ios::binary);
+    uint64_t nSetups = plant.size();
+    file.write(plantFileMagic, sizeof(plantFileMagic));
+    file.write(reinterpret_cast<const char*>(&nSetups), sizeof(nSetups));
+    for (int i = 0; i < plant.size(); ++i) {
+        const PanelSetup& setup = plant.getPanelSetup(i);
+        PlantFileRecord record = { setup.getAngle(), setup.getPanel().nElementsX(), setup.getPanel().nElementsY() };
+        file.write(reinterpret_cast<const char*>(&record), sizeof(record));
+    }
+    if (!file) throw std::runtime_error("savePlant: cannot write " + path);
+}
+
+class StreamingPlantEvaluator {
+public:
+    explicit StreamingPlantEvaluator(std::string path, size_t chunkSetups = size_t(1) << 20)
+        : m_path(std::move(path)), m_chunkSetups(std::max<size_t>(chunkSetups, 1)) {}
+
+    // total output of the plant in the file at every sun angle
+    std::vector<double> output(std::span<const double> sunAngles) const {
+        std::unique_ptr<std::FILE, int (*)(std::FILE*)> file(std::fopen(m_path.c_str(), "rb"), &std::fclose);
+        char magic[sizeof(plantFileMagic)];
+        uint64_t nSetups = 0;
+        if (!file || std::fread(magic, sizeof(magic), 1, file.get()) != 1 || !std::equal(magic, magic + sizeof(magic), plantFileMagic)
+            || std::fread(&nSetups, sizeof(nSetups), 1, file.get()) != 1)
+            throw std::runtime_error("StreamingPlantEvaluator: " + m_path + " is not a plant file");
+        std::setvbuf(file.get(), nullptr, _IONBF, 0); // the chunks are big enough, no need to copy through stdio
+
+        std::vector<double> cosSun(sunAngles.size()), sinSun(sunAngles.size()), total(sunAngles.size(), 0.0);
+        for (size_t k = 0; k < sunAngles.size(); ++k) {
+            cosSun[k] = std::cos(sunAngles[k]);
+            sinSun[k] = std::sin(sunAngles[k]);
+        }
+        auto read = [&](std::vector<PlantFileRecord>& chunk, uint64_t remaining) {
+            chunk.resize(std::min<uint64_t>(remaining, m_chunkSetups));
+            if (std::fread(chunk.data(), sizeof(PlantFileRecord), chunk.size(), file.get()) != chunk.size())
+                throw std::runtime_error("StreamingPlantEvaluator: " + m_path + " is truncated");
+        };
+
+        std::vector<PlantFileRecord> current, next;
+        uint64_t remaining = nSetups;
+        read(current, remaining);
+        remaining -= current.size();
+        std::mutex totalMutex;
+        while (!current.empty()) {
+            std::future<void> reading;
+            if (remaining > 0) reading = std::async(std::launch::async, read, std::ref(next), remaining);
+            ThreadPool::instance().parallelFor(current.size(), [&](size_t begin, size_t end) {
+                std::vector<double> partial(sunAngles.size(), 0.0);
+                for (size_t i = begin; i < end; ++i) {
+                    const PlantFileRecord& record = current[i];
+                    SinusoidTerm term = sinusoidTerm(record.tilt, SolarPanel(record.nElementsX, record.nElementsY).maxPowerinW());
+                    for (size_t k = 0; k < partial.size(); ++k)
+                        partial[k] += std::max(0.0, term.a * cosSun[k] + term.b * sinSun[k]);
+                }
+                std::lock_guard<std::mutex> lock(totalMutex);
+                for (size_t k = 0; k < partial.size(); ++k) total[k] += partial[k];
+            }, 4096);
+            if (reading.valid()) {
+                reading.get();
+                remaining -= next.size();
+            } else {
+                next.clear();
+            }
+            current.swap(next);
+        }
+        return total;
+    }
+
+private:
+    std::string m_path;
+    size_t m_chunkSetups;
+};
+
+
+// Exercise 16
+// Writing long profiles line by line through cout (and endl flushes every line) stalls the sweep on the disk.
+// AsyncFileSink collects the text in a few big buffers and hands every full buffer to the kernel without waiting:
+// with io_uring the buffers are registered once and written with batched submissions, where io_uring is not
+// available (old kernels, seccomp filters) a background thread writes them with pwrite. write() only blocks
+// when all buffers are on their way to the disk.
+
+// The bare minimum of io_uring on top of the system calls: submission and completion rings mapped into memory.
+class IoUring {
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0) return;
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (singleMap) m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+        m_sqRing = mapRing(m_sqRingSize, IORING_OFF_SQ_RING);
+        m_cqRing = singleMap ? m_sqRing : mapRing(m_cqRingSize, IORING_OFF_CQ_RING);
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe*>(mapRing(m_sqesSize, IORING_OFF_SQES));
+        if (!m_sqRing || !m_cqRing || !m_sqes) { close(); return; }
+        char* sq = static_cast<char*>(m_sqRing);
+        char* cq = static_cast<char*>(m_cqRing);
+        m_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        m_sqEntries = params.sq_entries;
+        m_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        m_localTail = *m_sqTail;
+    }
+    ~IoUring() { close(); }
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool ok() const { return m_fd >= 0; }
+
+    bool registerBuffers(const std::vector<iovec>& buffers) {
+        return syscall(__NR_io_uring_register, m_fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size()) == 0;
+    }
+
+    // a zeroed submission entry, nullptr if the ring is full (submit and reap first)
+    io_uring_sqe* nextSqe() {
+        unsigned head = std::atomic_ref<unsigned>(*m_sqHead).load(std::memory_order_acquire);
+        if (m_localTail - head == m_sqEntries) return nullptr;
+        unsigned index = m_localTail & m_sqMask;
+        m_sqArray[index] = index;
+        ++m_localTail;
+        ++m_unsubmitted;
+        io_uring_sqe* sqe = &m_sqes[index];
+        std::memset(sqe, 0, sizeof(*sqe));
+        return sqe;
+    }
+
+    // publishes the prepared entries to the kernel and optionally waits for completions
+    bool submit(unsigned waitFor = 0) {
+        std::atomic_ref<unsigned>(*m_sqTail).store(m_localTail, std::memory_order_release);
+        for (;;) {
+            long done = syscall(__NR_io_uring_enter, m_fd, m_unsubmitted, waitFor, waitFor ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (done >= 0) { m_unsubmitted -= static_cast<unsigned>(done); return true; }
+            if (errno != EINTR) return false;
+        }
+    }
+    unsigned unsubmitted() const { return m_unsubmitted; }
+
+    bool popCompletion(uint64_t& userData, int& result) {
+        unsigned head = *m_cqHead;
+        if (head == std::atomic_ref<unsigned>(*m_cqTail).load(std::memory_order_acquire)) return false;
+        const io_uring_cqe& cqe = m_cqes[head & m_cqMask];
+        userData = cqe.user_data;
+        result = cqe.res;
+        std::atomic_ref<unsigned>(*m_cqHead).store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    void* mapRing(size_t size, off_t offset) {
+        void* ring = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, offset);
+        return ring == MAP_FAILED ? nullptr : ring;
+    }
+    void close() {
+        if (m_sqes) munmap(m_sqes, m_sqesSize);
+        if (m_cqRing && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing) munmap(m_sqRing, m_sqRingSize);
+        if (m_fd >= 0) ::close(m_fd);
+        m_fd = -1;
+        m_sqRing = m_cqRing = nullptr;
+        m_sqes = nullptr;
+    }
+
+    int m_fd = -1;
+    void* m_sqRing = nullptr;
+    void* m_cqRing = nullptr;
+    io_uring_sqe* m_sqes = nullptr;
+    size_t m_sqRingSize = 0, m_cqRingSize = 0, m_sqesSize = 0;
+    unsigned *m_sqHead = nullptr, *m_sqTail = nullptr, *m_sqArray = nullptr;
+    unsigned *m_cqHead = nullptr, *m_cqTail = nullptr;
+    unsigned m_sqMask = 0, m_cqMask = 0, m_sqEntries = 0;
+    io_uring_cqe* m_cqes = nullptr;
+    unsigned m_localTail = 0;
+    unsigned m_unsubmitted = 0;
+};
+
+class AsyncFileSink {
+public:
+    // batch: number of full buffers handed to io_uring with one system call
+    explicit AsyncFileSink(const std::string& path, size_t bufferSize = size_t(1) << 20, unsigned nBuffers = 8,
+                           bool useIoUring = true, unsigned batch = 2)
+        : m_bufferSize(bufferSize), m_batch(std::max(1u, batch)) {
+        m_fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (m_fd < 0) throw std::runtime_error("AsyncFileSink: cannot open " + path);
+        nBuffers = std::max(2u, nBuffers);
+        std::vector<iovec> registered;
+        for (unsigned i = 0; i < nBuffers; ++i) {
+            m_buffers.push_back(std::make_unique<char[]>(bufferSize));
+            m_lengths.push_back(0);
+            registered.push_back({ m_buffers.back().get(), bufferSize });
+        }
+        if (useIoUring) {
+            m_ring = std::make_unique<IoUring>(nBuffers);
+            if (!m_ring->ok() || !m_ring->registerBuffers(registered)) m_ring.reset();
+        }
+        if (!m_ring) m_writer = std::thread([this] { writerLoop(); });
+        for (unsigned i = 1; i < nBuffers; ++i) m_free.push_back(i);
+        m_current = 0;
+    }
+    ~AsyncFileSink() {
+        try { flush(); } catch (...) {}
+        if (m_writer.joinable()) {
+            { std::lock_guard<std::mutex> lock(m_mutex); m_stop = true; }
+            m_changed.notify_all();
+            m_writer.join();
+        }
+        m_ring.reset();
+        ::close(m_fd);
+    }
+    AsyncFileSink(const AsyncFileSink&) = delete;
+    AsyncFileSink& operator=(const AsyncFileSink&) = delete;
+
+    bool usesIoUring() const { return m_ring != nullptr; }
+
+    void write(std::string_view text) {
+        while (!text.empty()) {
+            size_t n = std::min(text.size(), m_bufferSize - m_fill);
+            std::memcpy(m_buffers[m_current].get() + m_fill, text.data(), n);
+            m_fill += n;
+            text.remove_prefix(n);
+            if (m_fill == m_bufferSize) {
+                dispatch();
+                m_current = takeFreeBuffer();
+            }
+        }
+    }
+
+    // writes whatever is buffered and waits until all of it reached the file
+    void flush() {
+        if (m_fill > 0) {
+            dispatch();
+            m_current = takeFreeBuffer();
+        }
+        if (m_ring) {
+            while (m_inFlight > 0) submitAndReap();
+        } else {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_changed.wait(lock, [this] { return m_queue.empty() && m_writing == 0; });
+        }
+        if (m_error != 0) throw std::runtime_error(std::string("AsyncFileSink: write failed: ") + std::strerror(m_error));
+    }
+
+private:
+    // hands the current buffer to the kernel (or the writer thread) at the end of what was written so far
+    void dispatch() {
+        unsigned index = m_current;
+        m_lengths[index] = m_fill;
+        off_t offset = m_offset;
+        m_offset += m_fill;
+        m_fill = 0;
+        if (!m_ring) {
+            { std::lock_guard<std::mutex> lock(m_mutex); m_queue.push_back({ index, offset }); }
+            m_changed.notify_all();
+            return;
+        }
+        io_uring_sqe* sqe;
+        while (!(sqe = m_ring->nextSqe())) submitAndReap();
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->fd = m_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(m_buffers[index].get());
+        sqe->len = static_cast<uint32_t>(m_lengths[index]);
+        sqe->off = static_cast<uint64_t>(offset);
+        sqe->buf_index = static_cast<uint16_t>(index);
+        sqe->user_data = (static_cast<uint64_t>(offset) << 16) | index;
+        ++m_inFlight;
+        if (m_ring->unsubmitted() >= m_batch && !m_ring->submit()) throwSubmitError();
+    }
+
+    unsigned takeFreeBuffer() {
+        if (m_ring) {
+            while (m_free.empty()) submitAndReap();
+            unsigned index = m_free.back();
+            m_free.pop_back();
+            return index;
+        }
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this] { return !m_free.empty(); });
+        unsigned index = m_free.back();
+        m_free.pop_back();
+        return index;
+    }
+
+    // submits and waits for a completion; throws instead of letting the callers spin when io_uring_enter fails
+    void submitAndReap() {
+        if (!m_ring->submit(1)) throwSubmitError();
+        reap();
+    }
+    static void throwSubmitError() {
+        throw std::runtime_error(std::string("AsyncFileSink: io_uring_enter failed: ") + std::strerror(errno));
+    }
+
+    void reap() {
+        uint64_t userData;
+        int result;
+        while (m_ring->popCompletion(userData, result)) {
+            unsigned index = static_cast<unsigned>(userData & 0xffff);
+            off_t offset = static_cast<off_t>(userData >> 16);
+            if (result < 0) m_error = -result;
+            else if (static_cast<size_t>(result) < m_lengths[index]) // short write, finish it the simple way
+                writeFully(m_buffers[index].get() + result, m_lengths[index] - result, offset + result);
+            m_free.push_back(index);
+            --m_inFlight;
+        }
+    }
+
+    void writeFully(const char* data, size_t size, off_t offset) {
+        while (size > 0) {
+            ssize_t written = ::pwrite(m_fd, data, size, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                m_error = errno;
+                return;
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+    }
+
+    void writerLoop() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (;;) {
+            m_changed.wait(lock, [this] { return m_stop || !m_queue.empty(); });
+            if (m_queue.empty()) return;
+            auto [index, offset] = m_queue.front();
+            m_queue.pop_front();
+            ++m_writing;
+            lock.unlock();
+            writeFully(m_buffers[index].get(), m_lengths[index], offset);
+            lock.lock();
+            --m_writing;
+            m_free.push_back(index);
+            m_changed.notify_all();
+        }
+    }
+
+    int m_fd = -1;
+    size_t m_bufferSize;
+    unsigned m_batch;
+    std::vector<std::unique_ptr<char[]>> m_buffers;
+    std::vector<size_t> m_lengths;    // bytes to write from each dispatched buffer
+    unsigned m_current = 0;           // buffer being filled
+    size_t m_fill = 0;
+    off_t m_offset = 0;               // file offset of the current buffer
+    int m_error = 0;
+    std::vector<unsigned> m_free;
+
+    std::unique_ptr<IoUring> m_ring;
+    unsigned m_inFlight = 0;
+
+    // pwrite fallback
+    std::thread m_writer;
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+    std::deque<std::pair<unsigned, off_t>> m_queue;
+    unsigned m_writing = 0;
+    bool m_stop = false;
+};
+
+
+// Exercise 17
+// Formatting doubles with iostreams costs more than computing them. ProfileWriter formats a sweep
+// (sun angles and outputs) with std::to_chars straight into big buffers that are kept between calls,
+// chunks of rows are formatted in parallel and written out in order.
+// Exercise is the "angle; output" style of the loops in main(), with 6 significant digits like cout.
+
+enum class ProfileFormat { Csv, Tsv, Exercise };
+
+class ProfileWriter {
+public:
+    // precision 0 writes the shortest text that reads back to the same double, more than max_digits10 (17)
+    // significant digits add nothing and are clamped
+    explicit ProfileWriter(ProfileFormat format = ProfileFormat::Csv, int precision = -1, size_t rowsPerChunk = 65536)
+        : m_format(format),
+          m_precision(precision >= 0 ? std::min(precision, std::numeric_limits<double>::max_digits10)
+                                     : format == ProfileFormat::Exercise ? 6 : 0),
+          m_rowsPerChunk(std::max<size_t>(rowsPerChunk, 1)) {}
+
+    void write(AsyncFileSink& sink, std::span<const double> angles, std::span<const double> outputs, bool header = true) {
+        format(angles, outputs, header, [&](std::string_view text) { sink.write(text); });
+    }
+    void write(std::ostream& out, std::span<const double> angles, std::span<const double> outputs, bool header = true) {
+        format(angles, outputs, header, [&](std::string_view text) { out.write(text.data(), text.size()); });
+    }
+
+private:
+    template <class Output>
+    void format(std::span<const double> angles, std::span<const double> outputs, bool header, Output output) {
+        if (header && m_format != ProfileFormat::Exercise)
+            output(m_format == ProfileFormat::Csv ? "sun_angle,output\n" : "sun_angle\toutput\n");
+        std::string_view separator = m_format == ProfileFormat::Csv ? "," : m_format == ProfileFormat::Tsv ? "\t" : "; ";
+        size_t nRows = std::min(angles.size(), outputs.size());
+        size_t nChunks = (nRows + m_rowsPerChunk - 1) / m_rowsPerChunk;
+        if (m_chunks.size() < nChunks) {
+            m_chunks.resize(nChunks);
+            m_lengths.resize(nChunks);
+        }
+        constexpr size_t maxRowLength = 2 * 32 + 4; // two doubles (at most 24 characters each) and the separators
+        constexpr size_t failed = std::numeric_limits<size_t>::max();
+        ThreadPool::instance().parallelFor(nChunks, [&](size_t first, size_t last) {
+            for (size_t chunk = first; chunk < last; ++chunk) {
+                size_t begin = chunk * m_rowsPerChunk, end = std::min(nRows, begin + m_rowsPerChunk);
+                std::string& buffer = m_chunks[chunk];
+                if (buffer.size() < (end - begin) * maxRowLength) buffer.resize((end - begin) * maxRowLength);
+                char* position = buffer.data();
+                char* limit = buffer.data() + buffer.size();
+                for (size_t row = begin; row < end && position; ++row) {
+                    position = number(position, limit, angles[row]);
+                    if (!position || size_t(limit - position) < separator.size()) { position = nullptr; break; }
+                    position = std::copy(separator.begin(), separator.end(), position);
+                    position = number(position, limit, outputs[row]);
+                    if (!position || position == limit) { position = nullptr; break; }
+                    *position++ = '\n';
+                }
+                m_lengths[chunk] = position ? size_t(position - buffer.data()) : failed;
+            }
+        });
+        for (size_t chunk = 0; chunk < nChunks; ++chunk) // checked here, the pool threads can't throw
+            if (m_lengths[chunk] == failed) throw std::runtime_error("ProfileWriter: a row does not fit its buffer");
+        for (size_t chunk = 0; chunk < nChunks; ++chunk) output(std::string_view(m_chunks[chunk].data(), m_lengths[chunk]));
+    }
+
+    // end of the number, nullptr when it doesn't fit before limit
+    char* number(char* position, char* limit, double value) const {
+        std::to_chars_result result = m_precision > 0 ? std::to_chars(position, limit, value, std::chars_format::general, m_precision)
+                                                      : std::to_chars(position, limit, value);
+        return result.ec == std::errc() ? result.ptr : nullptr;
+    }
+
+    ProfileFormat m_format;
+    int m_precision;
+    size_t m_rowsPerChunk;
+    std::vector<std::string> m_chunks; // reused formatting buffers, one per chunk of rows
+    std::vector<size_t> m_lengths;
+};
+
+
+// Exercise 19
+// ProfileCache keeps the output of a plant at fixed sun angles. When the plant changed it reads the plant's
+// journal and patches the profile: the contribution of the old setup is subtracted and the new one added,
+// so one changed setup costs one pass over the angles instead of a new sweep over the whole plant.
+// It starts over when the journal doesn't reach back far enough, or when the patches would cost more than
+// a fresh sweep (which also keeps the rounding of many patches in check).
+
+class ProfileCache {
+public:
+    ProfileCache(const SolarPlant& plant, std::vector<double> sunAngles)
+        : m_plant(plant), m_sunAngles(std::move(sunAngles)) { recompute(); }
+
+    const std::vector<double>& sunAngles() const { return m_sunAngles; }
+
+    const std::vector<double>& profile() {
+        if (m_version == m_plant.version()) return m_profile;
+        m_changes.clear();
+        if (!m_plant.changesSince(m_version, m_changes) || m_patchedSinceSweep + m_changes.size() > size_t(m_plant.size())) {
+            recompute();
+            return m_profile;
+        }
+        LightSource sun;
+        for (const SolarPlant::JournalEntry& change : m_changes) {
+            for (size_t k = 0; k < m_sunAngles.size(); ++k) {
+                sun.setSourceAngle(m_sunAngles[k]);
+                m_profile[k] += change.after.currentPower(LuminationAngle(change.after, sun))
+                              - change.before.currentPower(LuminationAngle(change.before, sun));
+            }
+        }
+        m_patchedSinceSweep += m_changes.size();
+        ++m_nPatches;
+        m_version = m_plant.version();
+        return m_profile;
+    }
+
+    size_t nSweeps() const { return m_nSweeps; }
+    size_t nPatches() const { return m_nPatches; }
+
+private:
+    void recompute() {
+        m_profile.resize(m_sunAngles.size());
+        for (size_t k = 0; k < m_sunAngles.size(); ++k) m_profile[k] = m_plant.currentOutput(LightSource(m_sunAngles[k]));
+        m_version = m_plant.version();
+        m_patchedSinceSweep = 0;
+        ++m_nSweeps;
+    }
+
+    const SolarPlant& m_plant;
+    std::vector<double> m_sunAngles;
+    std::vector<double> m_profile;
+    unsigned long m_version = 0;
+    size_t m_patchedSinceSweep = 0;
+    size_t m_nSweeps = 0, m_nPatches = 0;
+    std::vector<SolarPlant::JournalEntry> m_changes; // reused between updates
+};
+
+
+// Exercise 20
+// Design exploration forks a base plant into many variants that differ in a few setups.
+// PlantVariant stores the setups in chunks shared between a variant and its forks; a chunk is copied only
+// when a variant modifies it (copy-on-write). Every chunk caches its own output profile, so the output of a
+// fresh variant only computes the chunks it changed and reuses the subtotals of everything shared with its parent.
+// Forks can be evaluated from several threads, a variant itself should be modified from one thread.
+
+class PlantVariant {
+public:
+    static constexpr size_t chunkSize = 64;
+
+    explicit PlantVariant(const SolarPlant& plant) : m_size(plant.size()) {
+        for (int begin = 0; begin < plant.size(); begin += int(chunkSize)) {
+            auto chunk = std::make_shared<Chunk>();
+            for (int i = begin; i < std::min(plant.size(), begin + int(chunkSize)); ++i) chunk->setups.push_back(plant.getPanelSetup(i));
+            m_chunks.push_back(std::move(chunk));
+        }
+    }
+
+    // a copy shares every chunk, the computed chunk count starts again at zero
+    PlantVariant(const PlantVariant& other) : m_chunks(other.m_chunks), m_size(other.m_size) {}
+    PlantVariant& operator=(const PlantVariant& other) {
+        m_chunks = other.m_chunks;
+        m_size = other.m_size;
+        m_computedChunks = 0;
+        return *this;
+    }
+    PlantVariant fork() const { return *this; }
+
+    int size() const { return m_size; }
+    const PanelSetup& getPanelSetup(int index) const { return m_chunks[index / chunkSize]->setups[index % chunkSize]; }
+
+    void setPanelSetup(const PanelSetup& setup, int index) {
+        std::shared_ptr<Chunk>& chunk = m_chunks[index / chunkSize];
+        if (chunk.use_count() > 1) {
+            auto copy = std::make_shared<Chunk>();
+            copy->setups = chunk->setups;
+            chunk = std::move(copy);
+        }
+        chunk->setups[index % chunkSize] = setup;
+        std::lock_guard<std::mutex> lock(chunk->mutex);
+        chunk->cachedAngles.clear();
+    }
+
+    // output at every sun angle, chunks evaluated for the same angles before are not computed again
+    std::vector<double> profile(std::span<const double> sunAngles) const {
+        std::vector<double> total(sunAngles.size(), 0.0);
+        for (const auto& chunk : m_chunks) {
+            std::lock_guard<std::mutex> lock(chunk->mutex);
+            if (!std::equal(sunAngles.begin(), sunAngles.end(), chunk->cachedAngles.begin(), chunk->cachedAngles.end())) {
+                chunk->cachedAngles.assign(sunAngles.begin(), sunAngles.end());
+                chunk->cachedProfile.assign(sunAngles.size(), 0.0);
+                for (size_t k = 0; k < sunAngles.size(); ++k) {
+                    LightSource sun(sunAngles[k]);
+                    for (const PanelSetup& setup : chunk->setups)
+                        chunk->cachedProfile[k] += setup.currentPower(LuminationAngle(setup, sun));
+                }
+                ++m_computedChunks;
+            }
+            for (size_t k = 0; k < sunAngles.size(); ++k) total[k] += chunk->cachedProfile[k];
+        }
+        return total;
+    }
+    double currentOutput(const LightSource& source) const {
+        double angle = source.getSourceAngle();
+        return profile(std::span<const double>(&angle, 1))[0];
+    }
+
+    size_t sharedChunksWith(const PlantVariant& other) const {
+        size_t shared = 0;
+        for (size_t i = 0; i < std::min(m_chunks.size(), other.m_chunks.size()); ++i) shared += m_chunks[i] == other.m_chunks[i];
+        return shared;
+    }
+    // how many chunk subtotals this variant had to compute itself
+    size_t computedChunks() const { return m_computedChunks; }
+
+    SolarPlant toSolarPlant() const {
+        SolarPlant plant(0);
+        for (const auto& chunk : m_chunks)
+            for (const PanelSetup& setup : chunk->setups) plant.addPanelSetup(setup);
+        return plant;
+    }
+
+private:
+    struct Chunk {
+        std::vector<PanelSetup> setups;
+        std::mutex mutex; // guards the cache, forks on other threads may be evaluating the same chunk
+        std::vector<double> cachedAngles, cachedProfile;
+    };
+    std::vector<std::shared_ptr<Chunk>> m_chunks;
+    int m_size;
+    mutable std::atomic<size_t> m_computedChunks{ 0 };
+
+};
+
+
+// Exercise 21
+// Sweeps over millions of designs outgrow one process (one allocator, one NUMA node, one crash takes everything).
+// ShardedSweepRunner forks worker processes that take shards of design indices from a counter in shared memory
+// and write their results straight into a shared results array; the parent works the queue too and then reaps them.
+// Workers see the designs through the copy-on-write pages fork gives them, nothing is serialized.
+// evaluate runs in the forked workers as well as in the parent. It may use the model classes, plants and the
+// tools built on them, ThreadPool (pools from before the fork run inline, new ones get their own threads)
+// and Logger (records are written right away in a worker). It must not rely on locks or background threads
+// of the parent's other objects (e.g. a shared ScenarioEngine cache or an AsyncFileSink), and its only way
+// back to the parent is the returned value: anything else it changes stays in the worker.
+
+class ShardedSweepRunner {
+public:
+    explicit ShardedSweepRunner(int nWorkers = int(std::thread::hardware_concurrency()), size_t shardSize = 64)
+        : m_nWorkers(std::max(nWorkers, 1)), m_shardSize(std::max<size_t>(shardSize, 1)) {}
+
+    // results[i] = evaluate(i) for i in [0, n), throws if a worker process failed
+    std::vector<double> run(size_t n, const std::function<double(size_t)>& evaluate) const {
+        static_assert(std::atomic<size_t>::is_always_lock_free, "the shard counter has to work across processes");
+        size_t bytes = sizeof(SharedHeader) + n * sizeof(double);
+        void* region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) throw std::runtime_error(std::string("ShardedSweepRunner: mmap failed: ") + std::strerror(errno));
+        SharedHeader* header = new (region) SharedHeader;
+        double* results = reinterpret_cast<double*>(header + 1);
+
+        std::cout.flush(); // or the children would inherit (and never write) the pending output
+        std::fflush(nullptr);
+        Logger::flush();   // same for the queued log records, this also starts the logger before the fork
+        std::vector<pid_t> workers;
+        for (int w = 1; w < m_nWorkers && n > m_shardSize * workers.size(); ++w) {
+            pid_t pid = fork();
+            if (pid < 0) break; // the remaining workers' shards go to the others
+            if (pid == 0) {
+                int status = 0;
+                try { work(n, evaluate, header, results); } catch (...) { status = 1; }
+                _exit(status); // no destructors or atexit handlers of the parent's objects
+            }
+            workers.push_back(pid);
+        }
+        std::exception_ptr error;
+        try { work(n, evaluate, header, results); } catch (...) { error = std::current_exception(); }
+
+        bool workerFailed = false;
+        for (pid_t pid : workers) {
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {}
+            workerFailed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+        }
+        std::vector<double> out(results, results + n);
+        munmap(region, bytes);
+        if (error) std::rethrow_exception(error);
+        if (workerFailed) throw std::runtime_error("ShardedSweepRunner: a worker process failed");
+        return out;
+    }
+
+    int workers() const { return m_nWorkers; }
+
+private:
+    struct SharedHeader {
+        std::atomic<size_t> next{ 0 };
+    };
+
+    void work(size_t n, const std::function<double(size_t)>& evaluate, SharedHeader* header, double* results) const {
+        for (;;) {
+            size_t begin = header->next.fetch_add(m_shardSize, std::memory_order_relaxed);
+            if (begin >= n) return;
+            for (size_t i = begin; i < std::min(n, begin + m_shardSize); ++i) results[i] = evaluate(i);
+        }
+    }
+
+    int m_nWorkers;
+    size_t m_shardSize;
+};
+
+
+// Exercise 22
+// On a multi-socket machine a plant filled by one thread lives in that socket's memory and the sweeps of the other
+// socket's cores read all of it remotely. NumaPartitionedPlant splits the setups into one contiguous part per NUMA
+// node (sized by the node's CPUs); each part has its own ThreadPool pinned to the node's CPUs, and these threads are
+// the first to write the part's pages, so the kernel's default first-touch policy places them on that node.
+// The topology comes from /sys (no libnuma needed); without it everything is one node using all allowed CPUs.
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;
+};
+
+// "0-3,8-11" -> 0 1 2 3 8 9 10 11
+inline std::vector<int> parseCpuList(std::string_view list) {
+    std::vector<int> cpus;
+    while (!list.empty()) {
+        size_t comma = list.find(',');
+        std::string_view range = list.substr(0, comma);
+        list = comma == std::string_view::npos ? std::string_view() : list.substr(comma + 1);
+        int first = 0, last = -1;
+        auto [end, ec] = std::from_chars(range.data(), range.data() + range.size(), first);
+        if (ec != std::errc()) continue;
+        last = first;
+        if (end != range.data() + range.size() && *end == '-') std::from_chars(end + 1, range.data() + range.size(), last);
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// Nodes with at least one CPU this process may run on, sorted by id.
+inline std::vector<NumaNode> numaNodes() {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) CPU_SET(cpu, &allowed);
+    auto isAllowed = [&](int cpu) { return cpu >= 0 && cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed); };
+
+    std::vector<NumaNode> nodes;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator("/sys/devices/system/node", error)) {
+        std::string name = entry.path().filename().string();
+        int id = 0;
+        if (name.rfind("node", 0) != 0 || std::from_chars(name.data() + 4, name.data() + name.size(), id).ec != std::errc()) continue;
+        std::ifstream file(entry.path() / "cpulist");
+        std::string list;
+        std::getline(file, list);
+        NumaNode node{ id, {} };
+        for (int cpu : parseCpuList(list))
+            if (isAllowed(cpu)) node.cpus.push_back(cpu);
+        if (!node.cpus.empty()) nodes.push_back(std::move(node)); // memory-only nodes have nobody to touch their pages
+    }
+    if (nodes.empty()) {
+        NumaNode node{ 0, {} };
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+            if (isAllowed(cpu)) node.cpus.push_back(cpu);
+        nodes.push_back(std::move(node));
+    }
+    std::sort(nodes.begin(), nodes.end(), [](const NumaNode& l, const NumaNode& r) { return l.id < r.id; });
+    return nodes;
+}
+
+class NumaPartitionedPlant {
+public:
+    // no nodes given means the nodes of this machine
+    explicit NumaPartitionedPlant(const SolarPlant& plant, std::vector<NumaNode> nodes = numaNodes()) : m_size(plant.size()) {
+        if (nodes.empty()) nodes = numaNodes();
+        size_t totalCpus = 0;
+        for (const NumaNode& node : nodes) totalCpus += std::max<size_t>(node.cpus.size(), 1);
+        size_t begin = 0, cpusBefore = 0;
+        for (NumaNode& node : nodes) {
+            cpusBefore += std::max<size_t>(node.cpus.size(), 1);
+            size_t end = size_t(m_size) * cpusBefore / totalCpus;
+            m_parts.push_back(std::make_unique<Part>(std::move(node), begin, end - begin));
+            begin = end;
+        }
+        // the node's own threads compute (and so first touch) its terms, all nodes at once
+        ThreadPool::Group group;
+        for (auto& part : m_parts) {
+            group.start(*part->pool, part->count, [&plant, p = part.get()](size_t first, size_t last) {
+                for (size_t i = first; i < last; ++i) {
+                    SinusoidTerm term = sinusoidTerm(plant.getPanelSetup(int(p->begin + i)));
+                    p->a[i] = term.a;
+                    p->b[i] = term.b;
+                }
+            });
+        }
+        group.wait();
+    }
+
+    int size() const { return m_size; }
+    size_t nodes() const { return m_parts.size(); }
+    const NumaNode& node(size_t part) const { return m_parts[part]->node; }
+    // setups [begin, begin + count) of the plant live on node(part)
+    std::pair<size_t, size_t> range(size_t part) const { return { m_parts[part]->begin, m_parts[part]->count }; }
+
+    // output at every sun angle, each node sums its own setups with its own threads
+    std::vector<double> profile(std::span<const double> sunAngles) const {
+        std::vector<double> cosines(sunAngles.size()), sines(sunAngles.size());
+        for (size_t k = 0; k < sunAngles.size(); ++k) {
+            cosines[k] = std::cos(sunAngles[k]);
+            sines[k] = std::sin(sunAngles[k]);
+        }
+        std::vector<double> total(sunAngles.size(), 0.0);
+        std::mutex totalMutex;
+        ThreadPool::Group group; // all node pools work at once, no threads are started per query
+        for (const auto& part : m_parts) {
+            group.start(*part->pool, part->count, [&, p = part.get()](size_t first, size_t last) {
+                std::vector<double> partial(sunAngles.size(), 0.0);
+                for (size_t k = 0; k < sunAngles.size(); ++k) {
+                    double sum = 0;
+                    for (size_t i = first; i < last; ++i) sum += std::max(0.0, p->a[i] * cosines[k] + p->b[i] * sines[k]);
+                    partial[k] = sum;
+                }
+                std::lock_guard<std::mutex> lock(totalMutex);
+                for (size_t k = 0; k < sunAngles.size(); ++k) total[k] += partial[k];
+            }, 4096);
+        }
+        group.wait();
+        return total;
+    }
+    double currentOutput(const LightSource& source) const {
+        double angle = source.getSourceAngle();
+        return profile(std::span<const double>(&angle, 1))[0];
+    }
+
+private:
+    struct Part {
+        Part(NumaNode n, size_t first, size_t size) : node(std::move(n)), begin(first), count(size) {
+            std::vector<int> cpus = node.cpus;
+            pool = std::make_unique<ThreadPool>(unsigned(std::max<size_t>(cpus.size(), 1)), [cpus] {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                for (int cpu : cpus) CPU_SET(cpu, &set);
+                if (!cpus.empty()) sched_setaffinity(0, sizeof(set), &set); // unpinned if it fails
+            });
+            // straight from mmap so no page is touched before the node's threads write it
+            bytes = std::max<size_t>(2 * count * sizeof(double), 1);
+            void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) throw std::runtime_error(std::string("NumaPartitionedPlant: mmap failed: ") + std::strerror(errno));
+            a = static_cast<double*>(memory);
+            b = a + count;
+        }
+        ~Part() { munmap(a, bytes); }
+        Part(const Part&) = delete;
+        Part& operator=(const Part&) = delete;
+
+        NumaNode node;
+        size_t begin, count, bytes;
+        double* a;
+        double* b;
+        std::unique_ptr<ThreadPool> pool;
+    };
+
+    std::vector<std::unique_ptr<Part>> m_parts;
+    int m_size;
+};
+
+
+int main() {
+    // For Exercise 1
+    PanelSetup testSetup(-pi / 2, SolarPanel(10, 10));
+    testSetup.setNPanel(2,3);
+    // play with methods like currentPower or efficiency to make sure they work as expected
+    cout << testSetup.currentPower(pi / 2) << "; " << testSetup.efficiency(pi) << endl;
+
+    // For remaining exercises
+    // construct a default power plant and setup the source to change the angle from -90 to 90 (-pi/2, pi/2)
+    // and see the profile of the produced power
+    LightSource theSun;
+    theSun.setSourceAngle(-pi / 2);
+    SolarPlant powerPlant;
+    for(int i = 0; i<10; i++){
+        powerPlant.setPanelSetup(testSetup, i);
+    }
+    while (theSun.getSourceAngle() < pi / 2) {
+        // calculate and print out of the plant
+        // powerPlant.currentOutput( theSun );
+
+        double tmpLumi = LuminationAngle(testSetup, theSun);
+        cout << testSetup.currentPower(tmpLumi) << "; " << powerPlant.currentOutput(theSun) << endl;
+        theSun.moveSourceAngleBy(pi / 16); // move the sun a bit in each cycle
+    }
+
+    // Exercise 5
+    // The produced power depends clearly on the position of the Sun
+    // Now we would like to have a more optimal plant that produces the energy in a bit more uniform way
+    // we want to prepare (insert PanelSetups in this plant) in a special way that not all SolarPanels have the same inclination angle.
+    // Something like this below:
+    // The \_/ illustrate incidence angles and numbers 1, 2, 3 .. denote positions of the sun during the day (changing angle).
+    // At zenith (position 3) the central panels will produce most of the power and in the morning (1) the rightmost panels will produce the most power and the leftmost very little.
+    //                                3   
+    //                           2         4   
+    //                        1               5
+    //
+    //                       \ \ \ \ _ _ / / / /
+    // 
+    // construct such a plant and use it in the same kind of loop as above.
+    theSun.setSourceAngle(-pi / 2);
+
+    
+    for (auto element : { 0,1,2,3 }) {
+        powerPlant.setPanelSetup(PanelSetup(pi / 4), element);
+        powerPlant.setNelementXYofaPanel(10,10, element); // You can put SolarPanel(x,y) inside the above PanelSetup argument intead.
+    }
+    for (auto element : { 4,5 }) {
+        // Why PanelSetup can use only 1 argument for 2-arguments constructor? Because it was having default arguments set before. The later just overwrite them.
+        powerPlant.setPanelSetup(PanelSetup(pi / 2), element);
+    }
+    for (auto element : { 6,7,8,9 }) {
+        powerPlant.setPanelSetup(PanelSetup(-pi / 4), element);
+    }
+    powerPlant.print();
+    // ... 
+
+    while (theSun.getSourceAngle() < pi / 2 + pi/16) {
+        cout << "Sun position: " << theSun.getSourceAngle() << "; Current output: " << powerPlant.currentOutput(theSun) << endl;
+        theSun.moveSourceAngleBy(pi / 16); // move the sun a bit in each cycle
+    }
+    // All of the sudden our few classes allow to study quite interesting optimistion problem. 
+    // That is how to setup the panels to get a flat energy profile per day. 
+    // One may maybe even model how much more power can be produced if panels could rotate? Would it be worth investment ...?
+
+    // Exercise 6
+    // Compare the Exercise 5 layout, a flat plant and a tracking plant over a few panel prices and sizes.
+    ScenarioEngine engine({ { pi / 4, pi / 4, pi / 4, pi / 4, pi / 2, pi / 2, -pi / 4, -pi / 4, -pi / 4, -pi / 4 }, { pi / 2 } },
+                          { { "budget", 0.25 }, { "premium", 0.45 } });
+    auto designs = engine.fullGrid({ { 20, 30 }, { 10, 10 } });
+    auto results = engine.evaluateGrid(designs);
+    for (size_t i = 0; i < designs.size(); ++i) {
+        cout << (designs[i].tracker == TrackerType::Fixed ? "fixed layout " + to_string(designs[i].layout) : string("tracker"))
+             << " sku " << designs[i].sku << " panel " << designs[i].dimX << "x" << designs[i].dimY
+             << ": " << results[i].annualEnergykWh << " kWh/year, NPV " << results[i].npv
+             << ", LCOE " << results[i].lcoe << ", payback " << results[i].paybackYears << " years" << endl;
+    }
+
+
+    // Exercise 7
+    // Search the whole energy / flatness / cost front, starting from the hand-made Exercise 5 layout.
+    LayoutOptimizer optimizer(powerPlant);
+    const ParetoFront& front = optimizer.run(64, 50, { { pi / 4, pi / 4, pi / 4, pi / 4, pi / 2, pi / 2, -pi / 4, -pi / 4, -pi / 4, -pi / 4 } });
+    cout << "Pareto front of " << front.members().size() << " layouts" << endl;
+    for (size_t i = 0; i < front.members().size(); i += std::max<size_t>(1, front.members().size() / 5)) {
+        const LayoutCandidate& layout = front.members()[i];
+        cout << "  energy " << layout.energyWh << " Wh, flatness " << layout.flatness << " W, cost " << layout.cost << endl;
+    }
+
+    // Exercise 8
+    // Best flat profile when only the three Exercise 5 mounting angles are available.
+    DiscreteTiltSolver solver(powerPlant, { pi / 4, pi / 2, -pi / 4 });
+    DiscreteTiltSolver::Solution best = solver.solve();
+    cout << "Best discrete layout (lowest output " << best.minOutput << " W, " << best.nodes << " nodes):";
+    for (double tilt : best.tilts) cout << " " << tilt;
+    cout << endl;
+
+    // Exercise 9
+    // Energy of the Exercise 5 plant over the day, the pi/16 sweep vs the adaptive integration.
+    IntegrationResult integral = integrateOutput(powerPlant, -pi / 2, pi / 2, 1e-10);
+    cout << "Daily energy: sweep " << dailyEnergyWh(powerPlant, 12, 16) << " Wh, adaptive "
+         << integral.value * 12 / pi << " Wh (+- " << integral.errorEstimate * 12 / pi << ", "
+         << integral.nEvaluations << " evaluations)" << endl;
+
+    // Exercise 10
+    // When is the peak and when does the Exercise 5 plant deliver more than 40 kW?
+    auto dailyPeak = powerPlant.peakOutput();
+    cout << "Peak output " << dailyPeak.second << " W at sun angle " << dailyPeak.first << endl;
+    for (const auto& interval : PlantOutputProfile(powerPlant).intervalsAbove(40000))
+        cout << "  above 40 kW from " << interval.first << " to " << interval.second << endl;
+
+    // Exercise 11
+    // Fast approximation of the output with a guaranteed error.
+    OutputSurrogate surrogate(powerPlant, 1e-3);
+    LightSource someSun;
+    someSun.setSourceAngle(0.3);
+    cout << "Surrogate at 0.3: " << surrogate.output(0.3) << " W (exact " << powerPlant.currentOutput(someSun)
+         << " W, " << surrogate.nPieces() << " pieces, error below " << surrogate.maxErrorBound() << " W)" << endl;
+
+    // Exercise 12
+    // Profile of the Exercise 5 plant from the precomputed table (every tilt in the table is 1 degree apart).
+    PowerTable table(181, 17);
+    std::vector<double> tabulated = table.profile(powerPlant);
+    cout << "Tabulated output at zenith: " << tabulated[8] << " W" << endl;
+
+    // Installed capacity of the Exercise 5 plant, kept up to date by the plant itself.
+    cout << "Installed capacity " << powerPlant.totalCapacityW() << " W, tilts from " << powerPlant.minTilt()
+         << " to " << powerPlant.maxTilt() << endl;
+    for (const auto& tilt : powerPlant.capacityPerTilt())
+        cout << "  tilt " << tilt.first << ": " << tilt.second.nSetups << " setups, " << tilt.second.capacityW << " W" << endl;
+
+    // Exercise 13
+    // The same plant with the layout fixed at compile time.
+    cout << "Fixed plant at sun angle 0.3: " << Exercise5Plant::currentOutput(0.3) << " W" << endl;
+
+    // Exercise 14
+    // The profile of the fixed plant, computed by the compiler and stored in the program as a table.
+    static constexpr auto bakedProfile = Exercise5Plant::profile<17>();
+    cout << "Compile-time profile:";
+    for (double output : bakedProfile) cout << " " << output;
+    cout << endl;
+
+    // Both numbers of Exercise 1 for a few sun positions at once.
+    LightSource positions[] = { LightSource(-pi / 4), LightSource(0), LightSource(pi / 4) };
+    double power[3], efficiency[3];
+    powerAndEfficiency(std::span<const PanelSetup>(&testSetup, 1), positions, power, efficiency);
+    for (int k = 0; k < 3; ++k)
+        cout << "Sun at " << positions[k].getSourceAngle() << ": " << power[k] << " W, " << efficiency[k] << " %" << endl;
+
+    // Same plant stored sorted by tilt, the setups keep their indices.
+    SolarPlant compacted = powerPlant;
+    compacted.compact();
+    cout << "Compacted plant, output at zenith " << compacted.currentOutput(LightSource(0)) << " W:" << endl;
+    compacted.print();
+
+    // Exercise 15
+    // The plant written to a file and evaluated from there, as if it did not fit in memory.
+    savePlant(powerPlant, "exercise5_plant.bin");
+    double streamedAngles[] = { -pi / 4, 0, pi / 4 };
+    std::vector<double> streamed = StreamingPlantEvaluator("exercise5_plant.bin").output(streamedAngles);
+    cout << "Streamed output: " << streamed[0] << " " << streamed[1] << " " << streamed[2] << endl;
+    std::remove("exercise5_plant.bin");
+
+    // Exercise 16
+    // A fine sweep of the day written to a file without stalling on the disk.
+    {
+        AsyncFileSink sink("exercise5_sweep.txt");
+        std::vector<double> sweepAngles, sweepOutputs;
+        for (int step = 0; step <= 1000; ++step) {
+            sweepAngles.push_back(-pi / 2 + step * pi / 1000);
+            sweepOutputs.push_back(powerPlant.currentOutput(LightSource(sweepAngles.back())));
+        }
+        ProfileWriter(ProfileFormat::Csv).write(sink, sweepAngles, sweepOutputs);
+        sink.flush();
+        cout << "Sweep written " << (sink.usesIoUring() ? "with io_uring" : "with pwrite") << endl;
+    }
+    std::remove("exercise5_sweep.txt");
+    // Exercise 17
+    // The Exercise 5 profile again, in its original text style but formatted without iostreams.
+    std::vector<double> sunAngles, outputs;
+    for (LightSource sun(-pi / 2); sun.getSourceAngle() < pi / 2 + pi / 16; sun.moveSourceAngleBy(pi / 16)) {
+        sunAngles.push_back(sun.getSourceAngle());
+        outputs.push_back(powerPlant.currentOutput(sun));
+    }
+    ProfileWriter(ProfileFormat::Exercise).write(cout, sunAngles, outputs);
+
+    // Exercise 18
+    // Re-tilting the whole plant as one edit: aggregates and caches (like the surrogate) are refreshed once.
+    PlantEditBatch retilt;
+    for (int i = 0; i < powerPlant.size(); ++i) retilt.setAngleOfaPanel(powerPlant.getPanelSetup(i).getAngle() * 0.9, i);
+    powerPlant.apply(retilt);
+    cout << "Re-tilted plant: tilts from " << powerPlant.minTilt() << " to " << powerPlant.maxTilt()
+         << ", output at 0.3 " << surrogate.output(0.3) << " W" << endl;
+
+    // Exercise 19
+    // The profile follows the plant edits without new sweeps.
+    ProfileCache cachedProfile(powerPlant, sunAngles);
+    powerPlant.setAngleOfaPanel(pi / 3, 0);
+    powerPlant.setNelementXYofaPanel(15, 15, 1);
+    cout << "Cached output at zenith after two edits: " << cachedProfile.profile()[8] << " W ("
+         << cachedProfile.nSweeps() << " sweep, " << cachedProfile.nPatches() << " patch)" << endl;
+
+    // Exercise 20
+    // A 1000 setup plant and a variant with one setup changed: the variant only evaluates the chunk it changed.
+    PlantVariant base(SolarPlant(1000));
+    base.profile(sunAngles);
+    PlantVariant variant = base.fork();
+    variant.setPanelSetup(PanelSetup(pi / 4), 500);
+    variant.profile(sunAngles);
+    cout << "Variant shares " << variant.sharedChunksWith(base) << " chunks with its base and computed "
+         << variant.computedChunks() << " of them" << endl;
+
+    // Exercise 21
+    // Daily energy of 200 rotated copies of the power plant, evaluated by 4 processes.
+    std::vector<double> tiltOffsets;
+    for (int i = 0; i < 200; ++i) tiltOffsets.push_back(-pi / 4 + i * (pi / 2) / 199);
+    std::vector<double> sweep = ShardedSweepRunner(4, 8).run(tiltOffsets.size(), [&](size_t i) {
+        SolarPlant plant = powerPlant;
+        for (int k = 0; k < plant.size(); ++k) plant.setAngleOfaPanel(plant.getPanelSetup(k).getAngle() + tiltOffsets[i], k);
+        return dailyEnergyWh(plant);
+    });
+    size_t bestOffset = std::max_element(sweep.begin(), sweep.end()) - sweep.begin();
+    cout << "Sharded sweep: best tilt offset " << tiltOffsets[bestOffset] << " with " << sweep[bestOffset] << " Wh" << endl;
+
+    // Exercise 22
+    // A 100000 setup plant split over the NUMA nodes of this machine.
+    SolarPlant bigPlant(0);
+    for (int i = 0; i < 100000; ++i) bigPlant.addPanelSetup(PanelSetup(-pi / 2 + (i % 181) * pi / 180));
+    NumaPartitionedPlant numaPlant(bigPlant);
+    theSun.setSourceAngle(pi / 8);
+    cout << "NUMA plant: " << numaPlant.nodes() << " node(s), output " << numaPlant.currentOutput(theSun)
+         << " W (plain " << bigPlant.currentOutput(theSun) << " W)" << endl;
 }